@@ -1,4 +1,88 @@
+import {Readable, ReadableOptions, Writable, WritableOptions} from "stream";
+
 /**
  * The include directory path
  */
-export const include: string;
\ No newline at end of file
+export const include: string;
+
+/**
+ * An async iterator returned by napi_tools::streams::channel
+ */
+export interface ChannelIterator<T> extends AsyncIterableIterator<T[]> {
+    /**
+     * Get the next chunk of values
+     *
+     * @param size the number of values or bytes requested
+     */
+    next(size?: number): Promise<IteratorResult<T[], undefined>>;
+
+    /**
+     * Stop reading from the channel
+     */
+    return(): Promise<IteratorResult<T[], undefined>>;
+
+    /**
+     * The capacity of the channel
+     */
+    readonly highWaterMark: number;
+
+    /**
+     * false, if the channel passes Buffers
+     */
+    readonly objectMode: boolean;
+}
+
+/**
+ * A writer returned by napi_tools::streams::sink
+ */
+export interface SinkWriter {
+    /**
+     * Pass Buffers to the native consumer without copying them
+     *
+     * @param buffers the Buffers to write
+     * @param callback called once the consumer released the Buffers
+     */
+    write(buffers: Buffer[], callback: (err?: Error) => void): void;
+
+    /**
+     * End the stream
+     *
+     * @param callback called once the consumer released all data, if false is returned
+     * @return true, if the consumer already released all data
+     */
+    end(callback: (err?: Error) => void): boolean;
+
+    /**
+     * Abort the stream and drop all data not yet read by the consumer
+     */
+    abort(): void;
+
+    /**
+     * The number of bytes to buffer while the consumer holds a batch
+     */
+    readonly highWaterMark: number;
+}
+
+export namespace streams {
+    /**
+     * Create a Readable stream reading from a channel.
+     * The native writers are paused once the
+     * highWaterMark of the stream is reached.
+     *
+     * @param iterator the channel iterator to read from
+     * @param options additional options passed to the Readable
+     * @return the Readable stream
+     */
+    function toReadable<T>(iterator: ChannelIterator<T>, options?: ReadableOptions): Readable;
+
+    /**
+     * Create a Writable stream writing to a native sink.
+     * Chunks are passed to the consumer without copying them,
+     * written Buffers may be reused once their write callback was called.
+     *
+     * @param writer the sink writer to write to
+     * @param options additional options passed to the Writable
+     * @return the Writable stream
+     */
+    function toWritable(writer: SinkWriter, options?: WritableOptions): Writable;
+}
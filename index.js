@@ -1,3 +1,110 @@
+const {Readable, Writable} = require('stream');
+
+/**
+ * Create a Readable stream reading from an async iterator
+ * returned by napi_tools::streams::channel::getIterator.
+ * The amount of data requested by the stream is passed to the
+ * iterator, so the native writers are paused once the
+ * highWaterMark of the stream is reached.
+ *
+ * @param iterator the async iterator to read from
+ * @param options additional options passed to the Readable
+ * @return the Readable stream
+ */
+function toReadable(iterator, options = {}) {
+    let reading = false;
+
+    const readable = new Readable({
+        highWaterMark: iterator.highWaterMark,
+        objectMode: iterator.objectMode,
+        ...options,
+        read(size) {
+            if (reading) return;
+            reading = true;
+
+            const pull = () => {
+                iterator.next(size).then(({value, done}) => {
+                    if (done) {
+                        reading = false;
+                        readable.push(null);
+                        return;
+                    }
+
+                    // Push the whole chunk in this turn, even if the stream is full
+                    let more = true;
+                    for (const v of value) {
+                        more = readable.push(v);
+                    }
+
+                    if (more) {
+                        pull();
+                    } else {
+                        reading = false;
+                    }
+                }, (err) => {
+                    reading = false;
+                    readable.destroy(err);
+                });
+            };
+
+            pull();
+        },
+        destroy(err, callback) {
+            Promise.resolve(iterator.return()).then(() => callback(err), callback);
+        }
+    });
+
+    return readable;
+}
+
+/**
+ * Create a Writable stream writing to a writer object
+ * returned by napi_tools::streams::sink::getWriter.
+ * Buffered chunks are passed to the native consumer in batches
+ * without copying them. The write callbacks are called once the
+ * consumer released the batch, so written Buffers may be reused
+ * afterwards. The stream buffers up to highWaterMark bytes meanwhile.
+ *
+ * @param writer the writer to write to
+ * @param options additional options passed to the Writable
+ * @return the Writable stream
+ */
+function toWritable(writer, options = {}) {
+    const writev = (chunks, callback) => {
+        try {
+            writer.write(chunks.map(c => c.chunk), callback);
+        } catch (e) {
+            callback(e);
+        }
+    };
+
+    return new Writable({
+        highWaterMark: writer.highWaterMark,
+        ...options,
+        write(chunk, encoding, callback) {
+            writev([{chunk}], callback);
+        },
+        writev,
+        final(callback) {
+            try {
+                if (writer.end(callback)) {
+                    callback();
+                }
+            } catch (e) {
+                callback(e);
+            }
+        },
+        destroy(err, callback) {
+            writer.abort();
+            callback(err);
+        }
+    });
+}
+
 module.exports = {
-    include: __dirname
-};
\ No newline at end of file
+    include: __dirname,
+    streams: {
+        toReadable,
+        toWritable
+    }
+};
@@ -1,9 +1,37 @@
 #include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
 #include <napi.h>
 #include "napi_tools.hpp"
 
 using namespace napi_tools;
 
+// Count the allocations made by this addon while measuring.
+// Requires the addon to bind its own symbols first, see CMakeLists.txt.
+static std::atomic<bool> count_allocations(false);
+static std::atomic<size_t> allocations(0);
+
+void *operator new(std::size_t size) {
+    if (count_allocations.load(std::memory_order_relaxed)) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (void *ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
 Napi::Promise promiseTest(const Napi::CallbackInfo &info) {
     TRY
         return promises::promise<std::string>(info.Env(), [] {
@@ -37,16 +65,25 @@ public:
     }
 };
 
-static callbacks::callback<void()> callback = nullptr;
+// One callback per environment, e.g. per worker thread
+static napi_tools::util::per_env<callbacks::callback<void()>> callback;
 static callbacks::callback<int(int)> int_callback = nullptr;
 static callbacks::callback<int(std::vector<std::string>)> vec_callback = nullptr;
 static callbacks::callback<custom_t(custom_t)> custom_callback = nullptr;
 static callbacks::callback<void(std::string)> str_callback = nullptr;
 static callbacks::callback<std::shared_ptr<std::promise<int>>()> promise_callback = nullptr;
+// Returns a promise in javascript, which is awaited before the call completes
+static callbacks::callback<int(int)> async_callback = nullptr;
+static callbacks::callback<void()> benchmark_callback = nullptr;
+static callbacks::callback<void(int)> allocation_callback = nullptr;
+// Has a capacity of one call, the oldest queued call is dropped if full
+static callbacks::callback<void(int)> overflow_callback = nullptr;
+static callbacks::callback_group<int(int)> worker_callbacks(callbacks::balancing::least_queued);
+static napi_tools::util::per_env<callbacks::broadcast<void(std::string)>> events;
 
 void setCallback(const Napi::CallbackInfo &info) {
     TRY
-        callback = callbacks::callback<void()>(info);
+        callback.get(info.Env()) = callbacks::callback<void()>(info);
     CATCH_EXCEPTIONS
 }
 
@@ -72,7 +109,7 @@ void setCustomCallback(const Napi::CallbackInfo &info) {
 
 Napi::Promise callMeMaybe(const Napi::CallbackInfo &info) {
     TRY
-        return promises::promise<void>(info.Env(), [] {
+        return promises::promise<void>(info.Env(), [callback = callback.get(info.Env())]() mutable {
             callback();
             str_callback("some string");
             std::promise<custom_t> pr;
@@ -108,9 +145,296 @@ void promiseCallback(const Napi::CallbackInfo &info) {
     }).detach();
 }
 
+Napi::Promise callAsyncCallback(const Napi::CallbackInfo &info) {
+    CHECK_ARGS(number);
+    const int value = info[0].ToNumber();
+
+    TRY
+        return promises::promise<int>(info.Env(), [value] {
+            return async_callback.callSync(value);
+        });
+    CATCH_EXCEPTIONS
+}
+
+Napi::Promise benchmarkCallback(const Napi::CallbackInfo &info) {
+    CHECK_ARGS(number);
+    const uint32_t count = std::max(info[0].ToNumber().Uint32Value(), 1u);
+
+    TRY
+        // Measure the time between queueing a call and the js function returning
+        return promises::promise<std::map<std::string, double>>(info.Env(), [count] {
+            std::vector<double> latencies;
+            for (uint32_t i = 0; i < count; i++) {
+                const auto start = std::chrono::steady_clock::now();
+                benchmark_callback.callSync();
+                const auto end = std::chrono::steady_clock::now();
+                latencies.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+            }
+
+            std::sort(latencies.begin(), latencies.end());
+
+            // Measure the number of async calls per second
+            std::promise<void> done;
+            std::atomic<uint32_t> remaining(count);
+            const auto finished = [&remaining, &done] {
+                if (--remaining == 0) done.set_value();
+            };
+
+            const auto start = std::chrono::steady_clock::now();
+            for (uint32_t i = 0; i < count; i++) {
+                benchmark_callback(finished, [finished](const napi_tools::exception &) {
+                    finished();
+                });
+            }
+
+            done.get_future().wait();
+            const auto end = std::chrono::steady_clock::now();
+
+            return std::map<std::string, double>{
+                    {"p50",            latencies[latencies.size() / 2]},
+                    {"p99",            latencies[latencies.size() * 99 / 100]},
+                    {"callsPerSecond", count / std::chrono::duration<double>(end - start).count()}
+            };
+        });
+    CATCH_EXCEPTIONS
+}
+
+Napi::Promise countCallAllocations(const Napi::CallbackInfo &info) {
+    CHECK_ARGS(number);
+    const uint32_t count = std::max(info[0].ToNumber().Uint32Value(), 1u);
+
+    TRY
+        // Count the allocations of calls made once the queues and the batch pool
+        // have grown. Every call is awaited, so the queues never grow any further.
+        return promises::promise<uint32_t>(info.Env(), [count] {
+            std::atomic<uint32_t> remaining(0);
+            const auto call = [&remaining](int i) {
+                remaining = 1;
+                allocation_callback(i, [&remaining] {
+                    remaining = 0;
+                    remaining.notify_one();
+                }, [&remaining](const napi_tools::exception &) {
+                    remaining = 0;
+                    remaining.notify_one();
+                });
+
+                remaining.wait(1);
+            };
+
+            for (uint32_t i = 0; i < count; i++) {
+                call(static_cast<int>(i));
+            }
+
+            allocations = 0;
+            count_allocations = true;
+            for (uint32_t i = 0; i < count; i++) {
+                call(static_cast<int>(i));
+            }
+
+            count_allocations = false;
+            const size_t counted = allocations.exchange(0);
+
+            // Make sure the counting operator new is used by this addon at all
+            count_allocations = true;
+            ::operator delete(::operator new(1));
+            count_allocations = false;
+            if (allocations.load() == 0) {
+                throw std::runtime_error("The counting operator new is not used");
+            }
+
+            return static_cast<uint32_t>(counted);
+        });
+    CATCH_EXCEPTIONS
+}
+
+Napi::Promise overflowCallback(const Napi::CallbackInfo &info) {
+    CHECK_ARGS(number);
+    const uint32_t count = info[0].ToNumber().Uint32Value();
+
+    TRY
+        // Overflow the callback from multiple threads. Every
+        // callSync must return or throw, even if its call is dropped.
+        return promises::promise<std::map<std::string, double>>(info.Env(), [count] {
+            std::atomic<uint32_t> returned(0), dropped(0);
+            std::vector<std::thread> threads;
+            for (uint32_t i = 0; i < count; i++) {
+                threads.emplace_back([&returned, &dropped, i] {
+                    try {
+                        overflow_callback.callSync(static_cast<int>(i));
+                        returned++;
+                    } catch (const std::exception &) {
+                        dropped++;
+                    }
+                });
+            }
+
+            for (auto &t : threads) {
+                t.join();
+            }
+
+            return std::map<std::string, double>{
+                    {"returned", returned.load()},
+                    {"dropped",  dropped.load()}
+            };
+        });
+    CATCH_EXCEPTIONS
+}
+
+Napi::Promise callWorkers(const Napi::CallbackInfo &info) {
+    CHECK_ARGS(number);
+    const uint32_t count = info[0].ToNumber().Uint32Value();
+
+    TRY
+        // Spread the calls across all environments which set a worker callback
+        return promises::promise<int>(info.Env(), [count] {
+            std::vector<std::future<int>> results;
+            for (uint32_t i = 0; i < count; i++) {
+                results.push_back(worker_callbacks.call(static_cast<int>(i)));
+            }
+
+            int sum = 0;
+            for (auto &f : results) {
+                sum += f.get();
+            }
+
+            return sum;
+        });
+    CATCH_EXCEPTIONS
+}
+
+Napi::Promise emitEvent(const Napi::CallbackInfo &info) {
+    CHECK_ARGS(string);
+    std::string event = info[0].ToString();
+
+    TRY
+        // Every listener is called with the event, the string is converted only once
+        return promises::promise<void>(info.Env(), [events = events.get(info.Env()), event]() mutable {
+            events.callSync(event);
+        });
+    CATCH_EXCEPTIONS
+}
+
+Napi::Value streamNumbers(const Napi::CallbackInfo &info) {
+    CHECK_ARGS(number);
+    const uint32_t count = info[0].ToNumber().Uint32Value();
+
+    TRY
+        streams::channel_options opts;
+        opts.capacity = 16;
+        streams::channel<uint32_t> channel(info.Env(), opts);
+
+        // The thread waits whenever javascript did not read the last 16 numbers yet
+        std::thread([channel, count]() mutable {
+            for (uint32_t i = 0; i < count; i++) {
+                if (!channel.write(i)) return;
+            }
+
+            channel.close();
+        }).detach();
+
+        return channel.getIterator(info.Env());
+    CATCH_EXCEPTIONS
+}
+
+Napi::Value streamBytes(const Napi::CallbackInfo &info) {
+    CHECK_ARGS(number);
+    const uint32_t count = info[0].ToNumber().Uint32Value();
+
+    TRY
+        // Buffer at most 64 KiB, the buffers are passed to javascript without copying
+        streams::channel_options opts;
+        opts.capacity = 64 * 1024;
+        streams::channel<streams::bytes> channel(info.Env(), opts);
+
+        std::thread([channel, count]() mutable {
+            for (uint32_t i = 0; i < count; i++) {
+                if (!channel.write(streams::bytes(1024, static_cast<uint8_t>(i)))) return;
+            }
+
+            channel.close();
+        }).detach();
+
+        return channel.getIterator(info.Env());
+    CATCH_EXCEPTIONS
+}
+
+Napi::Value consumeBytes(const Napi::CallbackInfo &info) {
+    TRY
+        streams::sink sink(info.Env());
+
+        // Read the Buffers written by javascript without copying them
+        Napi::Object res = Napi::Object::New(info.Env());
+        res.Set("writer", sink.getWriter(info.Env()));
+        promises::promise<uint64_t> total(info.Env(), [sink]() mutable {
+            uint64_t bytes = 0;
+            while (const auto batch = sink.read()) {
+                for (const std::span<const uint8_t> &chunk : *batch) {
+                    bytes += chunk.size();
+                }
+            }
+
+            return bytes;
+        });
+
+        res.Set("total", total.getPromise());
+        return res;
+    CATCH_EXCEPTIONS
+}
+
+Napi::Value consumeBytesReused(const Napi::CallbackInfo &info) {
+    TRY
+        streams::sink sink(info.Env());
+
+        // Read into a single batch object. Assigning to it must release the
+        // batch it holds, otherwise javascript never writes the next chunks.
+        Napi::Object res = Napi::Object::New(info.Env());
+        res.Set("writer", sink.getWriter(info.Env()));
+        promises::promise<uint64_t> total(info.Env(), [sink]() mutable {
+            uint64_t bytes = 0;
+            std::optional<streams::sink::batch> current;
+            while (auto next = sink.read()) {
+                if (current) {
+                    *current = std::move(*next);
+                } else {
+                    current.emplace(std::move(*next));
+                }
+
+                for (const std::span<const uint8_t> &chunk : *current) {
+                    bytes += chunk.size();
+                }
+
+                // next was moved from, so this releases the batch read
+                *current = std::move(*next);
+            }
+
+            return bytes;
+        });
+
+        res.Set("total", total.getPromise());
+        return res;
+    CATCH_EXCEPTIONS
+}
+
 void stopCallback(const Napi::CallbackInfo &info) {
     TRY
-        callback.stop();
+        callback.get(info.Env()).stop();
+    CATCH_EXCEPTIONS
+}
+
+void stopCallbacks(const Napi::CallbackInfo &info) {
+    TRY
+        callback.get(info.Env()).stop();
+        int_callback.stop();
+        vec_callback.stop();
+        custom_callback.stop();
+        str_callback.stop();
+        promise_callback.stop();
+        async_callback.stop();
+        benchmark_callback.stop(callbacks::shutdown_policy::discard);
+        allocation_callback.stop();
+        overflow_callback.stop();
+        worker_callbacks.stop();
+        events.get(info.Env()).stop();
     CATCH_EXCEPTIONS
 }
 
@@ -119,6 +443,10 @@ void checkNullOrUndefined(const Napi::CallbackInfo &info) {
 }
 
 Napi::Object InitAll(Napi::Env env, Napi::Object exports) {
+    // The tests run several blocking promises at once, use up to eight threads. Has no
+    // effect if the addon is loaded again in a worker thread, as the pool is already running then.
+    promises::setThreadPoolSize(std::clamp(std::thread::hardware_concurrency(), 2u, 8u));
+
     EXPORT_FUNCTION(exports, env, promiseTest);
     EXPORT_FUNCTION(exports, env, setCallback);
     EXPORT_FUNCTION(exports, env, setIntCallback);
@@ -126,10 +454,37 @@ Napi::Object InitAll(Napi::Env env, Napi::Object exports) {
     EXPORT_FUNCTION(exports, env, setCustomCallback);
     EXPORT_FUNCTION(exports, env, callMeMaybe);
     EXPORT_FUNCTION(exports, env, stopCallback);
+    EXPORT_FUNCTION(exports, env, stopCallbacks);
     EXPORT_FUNCTION(exports, env, checkNullOrUndefined);
     EXPORT_FUNCTION(exports, env, promiseCallback);
+    EXPORT_FUNCTION(exports, env, callAsyncCallback);
+    EXPORT_FUNCTION(exports, env, benchmarkCallback);
+    EXPORT_FUNCTION(exports, env, countCallAllocations);
+    EXPORT_FUNCTION(exports, env, overflowCallback);
+    EXPORT_FUNCTION(exports, env, callWorkers);
+    EXPORT_FUNCTION(exports, env, emitEvent);
+    EXPORT_FUNCTION(exports, env, streamNumbers);
+    EXPORT_FUNCTION(exports, env, streamBytes);
+    EXPORT_FUNCTION(exports, env, consumeBytes);
+    EXPORT_FUNCTION(exports, env, consumeBytesReused);
+    callbacks::options str_options;
+    str_options.max_batch_size = 16;
+    str_options.max_linger = std::chrono::milliseconds(1);
+    str_callback.setOptions(str_options);
     str_callback.exportSetter(env, exports, "setStrCallback");
     promise_callback.exportSetter(env, exports, "setPromiseCallback");
+    async_callback.exportSetter(env, exports, "setAsyncCallback");
+    benchmark_callback.exportSetter(env, exports, "setBenchmarkCallback");
+    benchmark_callback.exportStats(env, exports, "getBenchmarkStats");
+    allocation_callback.exportSetter(env, exports, "setAllocationCallback");
+    callbacks::options overflow_options;
+    overflow_options.capacity = 1;
+    overflow_options.policy = callbacks::overflow_policy::drop_oldest;
+    overflow_callback.setOptions(overflow_options);
+    overflow_callback.exportSetter(env, exports, "setOverflowCallback");
+    worker_callbacks.exportSetter(env, exports, "setWorkerCallback");
+    events.get(env) = callbacks::broadcast<void(std::string)>(env);
+    events.get(env).exportListeners(env, exports, "addEventListener", "removeEventListener");
 
     return exports;
 }
@@ -30,10 +30,32 @@
 #include <thread>
 #include <memory>
 #include <future>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
 #include <sstream>
 #include <map>
+#include <unordered_map>
+#include <limits>
+#include <deque>
 #include <iostream>
 #include <utility>
+#include <functional>
+#include <type_traits>
+#include <new>
+#include <cstddef>
+#include <array>
+#include <optional>
+#include <span>
+#include <bit>
+#include <cmath>
+#include <stop_token>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#   include <coroutine>
+#   define NAPI_TOOLS_COROUTINES
+#endif
 
 #define TRY try {
 #define CATCH_EXCEPTIONS                                                 \
@@ -55,6 +77,25 @@
 // Export a n-api function with the name of func, an environment and the exports variable
 #define EXPORT_FUNCTION(exports, env, func) exports.Set(#func, ::Napi::Function::New(env, func))
 
+// Record a span until the end of the current scope. Compiles to nothing unless NAPI_TOOLS_TRACING is defined.
+#ifdef NAPI_TOOLS_TRACING
+#   include <fstream>
+#   ifndef NAPI_TOOLS_TRACING_BUFFER_SIZE
+#       define NAPI_TOOLS_TRACING_BUFFER_SIZE 65536
+#   endif //NAPI_TOOLS_TRACING_BUFFER_SIZE
+#   ifndef NAPI_TOOLS_TRACING_MAX_RETIRED
+#       define NAPI_TOOLS_TRACING_MAX_RETIRED 16
+#   endif //NAPI_TOOLS_TRACING_MAX_RETIRED
+#   define NAPI_TOOLS_TRACE_CONCAT_(a, b) a##b
+#   define NAPI_TOOLS_TRACE_CONCAT(a, b) NAPI_TOOLS_TRACE_CONCAT_(a, b)
+#   define NAPI_TOOLS_TRACE_SPAN(category, name) \
+        ::napi_tools::tracing::span NAPI_TOOLS_TRACE_CONCAT(napi_tools_trace_span_, __LINE__)(category, name)
+#   define NAPI_TOOLS_TRACE_INSTANT(category, name) ::napi_tools::tracing::instant(category, name)
+#else
+#   define NAPI_TOOLS_TRACE_SPAN(category, name)
+#   define NAPI_TOOLS_TRACE_INSTANT(category, name)
+#endif //NAPI_TOOLS_TRACING
+
 /**
  * The napi_tools namespace
  */
@@ -179,6 +220,496 @@ namespace napi_tools {
             }
         }
 
+        /**
+         * A move-only function wrapper. Callables which fit into the internal
+         * buffer and are nothrow move constructible are stored without allocating.
+         * Unlike std::function, move-only callables, e.g. lambdas capturing
+         * a std::promise, can be stored.
+         */
+        template<class>
+        class unique_function;
+
+        /**
+         * Check if T is a std::function
+         */
+        template<class T>
+        struct is_std_function : std::false_type {};
+
+        template<class T>
+        struct is_std_function<std::function<T>> : std::true_type {};
+
+        /**
+         * A move-only function wrapper
+         *
+         * @tparam R the return type
+         * @tparam Args the argument types
+         */
+        template<class R, class...Args>
+        class unique_function<R(Args...)> {
+        public:
+            /**
+             * Create an empty function
+             */
+            unique_function() noexcept = default;
+
+            /**
+             * Create an empty function
+             */
+            unique_function(std::nullptr_t) noexcept {}
+
+            /**
+             * Create a function from a callable
+             *
+             * @tparam F the callable type
+             * @param f the callable to store
+             */
+            template<class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, unique_function> &&
+                                                       std::is_invocable_r_v<R, std::decay_t<F> &, Args...>>>
+            unique_function(F &&f) {
+                using T = std::decay_t<F>;
+                if constexpr (std::is_pointer_v<T> || std::is_member_pointer_v<T> || is_std_function<T>::value) {
+                    // Keep empty functions empty
+                    if (!f) return;
+                }
+
+                if constexpr (stored_locally<T>) {
+                    new(buffer) T(std::forward<F>(f));
+                } else {
+                    *reinterpret_cast<T **>(buffer) = new T(std::forward<F>(f));
+                }
+
+                vtable = &vtable_for<T>;
+            }
+
+            /**
+             * Move constructor
+             *
+             * @param other the function to move
+             */
+            unique_function(unique_function &&other) noexcept {
+                move_from(other);
+            }
+
+            /**
+             * Move assignment operator
+             *
+             * @param other the function to move
+             * @return this
+             */
+            unique_function &operator=(unique_function &&other) noexcept {
+                if (this != &other) {
+                    reset();
+                    move_from(other);
+                }
+
+                return *this;
+            }
+
+            /**
+             * Clear the function
+             *
+             * @return this
+             */
+            unique_function &operator=(std::nullptr_t) noexcept {
+                reset();
+                return *this;
+            }
+
+            unique_function(const unique_function &) = delete;
+
+            unique_function &operator=(const unique_function &) = delete;
+
+            /**
+             * Call the function. The function must not be empty.
+             *
+             * @param args the function arguments
+             * @return the function return value
+             */
+            inline R operator()(Args...args) {
+                return vtable->invoke(buffer, std::forward<Args>(args)...);
+            }
+
+            /**
+             * Check if this function is not empty
+             *
+             * @return true, if a callable is stored
+             */
+            [[nodiscard]] inline explicit operator bool() const noexcept {
+                return vtable != nullptr;
+            }
+
+            /**
+             * Destroy the stored callable
+             */
+            ~unique_function() {
+                reset();
+            }
+
+        private:
+            // The size of the internal buffer
+            static constexpr size_t buffer_size = 6 * sizeof(void *);
+
+            template<class T>
+            static constexpr bool stored_locally = sizeof(T) <= buffer_size &&
+                                                   alignof(T) <= alignof(std::max_align_t) &&
+                                                   std::is_nothrow_move_constructible_v<T>;
+
+            // The operations on a stored callable
+            struct vtable_t {
+                R (*invoke)(void *, Args &&...);
+
+                void (*move)(void *, void *) noexcept;
+
+                void (*destroy)(void *) noexcept;
+            };
+
+            // Get the stored callable from the buffer
+            template<class T>
+            static T &get(void *buf) noexcept {
+                if constexpr (stored_locally<T>) {
+                    return *std::launder(reinterpret_cast<T *>(buf));
+                } else {
+                    return **reinterpret_cast<T **>(buf);
+                }
+            }
+
+            template<class T>
+            static R invoke_fn(void *buf, Args &&...args) {
+                return std::invoke(get<T>(buf), std::forward<Args>(args)...);
+            }
+
+            template<class T>
+            static void move_fn(void *dst, void *src) noexcept {
+                if constexpr (stored_locally<T>) {
+                    new(dst) T(std::move(get<T>(src)));
+                    get<T>(src).~T();
+                } else {
+                    *reinterpret_cast<T **>(dst) = *reinterpret_cast<T **>(src);
+                }
+            }
+
+            template<class T>
+            static void destroy_fn(void *buf) noexcept {
+                if constexpr (stored_locally<T>) {
+                    get<T>(buf).~T();
+                } else {
+                    delete *reinterpret_cast<T **>(buf);
+                }
+            }
+
+            template<class T>
+            static constexpr vtable_t vtable_for{&invoke_fn<T>, &move_fn<T>, &destroy_fn<T>};
+
+            inline void move_from(unique_function &other) noexcept {
+                if (other.vtable) {
+                    other.vtable->move(buffer, other.buffer);
+                    vtable = other.vtable;
+                    other.vtable = nullptr;
+                }
+            }
+
+            inline void reset() noexcept {
+                if (vtable) {
+                    vtable->destroy(buffer);
+                    vtable = nullptr;
+                }
+            }
+
+            alignas(std::max_align_t) unsigned char buffer[buffer_size]{};
+            const vtable_t *vtable = nullptr;
+        };
+
+        /**
+         * A std::shared_ptr which may be loaded and replaced concurrently.
+         * Readers keep the loaded instance alive while using it.
+         *
+         * @tparam T the type of the stored object
+         */
+        template<class T>
+        class atomic_shared_ptr {
+        public:
+            /**
+             * Create an atomic_shared_ptr
+             *
+             * @param p the pointer to store
+             */
+            atomic_shared_ptr(std::shared_ptr<T> p = nullptr) noexcept: ptr(std::move(p)) {}
+
+            /**
+             * Copy an atomic_shared_ptr
+             *
+             * @param other the pointer to copy
+             */
+            atomic_shared_ptr(const atomic_shared_ptr &other) : ptr(other.load()) {}
+
+            /**
+             * Copy-assign an atomic_shared_ptr
+             *
+             * @param other the pointer to copy
+             * @return this
+             */
+            atomic_shared_ptr &operator=(const atomic_shared_ptr &other) {
+                if (this != &other) {
+                    store(other.load());
+                }
+
+                return *this;
+            }
+
+            /**
+             * Load the stored pointer
+             *
+             * @return the stored pointer
+             */
+            [[nodiscard]] inline std::shared_ptr<T> load() const {
+#ifdef __cpp_lib_atomic_shared_ptr
+                return ptr.load(std::memory_order_acquire);
+#else
+                std::unique_lock<std::mutex> lock(mtx);
+                return ptr;
+#endif
+            }
+
+            /**
+             * Replace the stored pointer. The previous
+             * instance is released after it has been replaced.
+             *
+             * @param p the new pointer
+             */
+            inline void store(std::shared_ptr<T> p) {
+                exchange(std::move(p));
+            }
+
+            /**
+             * Replace the stored pointer
+             *
+             * @param p the new pointer
+             * @return the previous pointer
+             */
+            inline std::shared_ptr<T> exchange(std::shared_ptr<T> p) {
+#ifdef __cpp_lib_atomic_shared_ptr
+                return ptr.exchange(std::move(p), std::memory_order_acq_rel);
+#else
+                std::unique_lock<std::mutex> lock(mtx);
+                ptr.swap(p);
+                return p;
+#endif
+            }
+
+        private:
+#ifdef __cpp_lib_atomic_shared_ptr
+            std::atomic<std::shared_ptr<T>> ptr;
+#else
+            mutable std::mutex mtx;
+            std::shared_ptr<T> ptr;
+#endif
+        };
+
+        /**
+         * Data stored per environment. Destroyed by a cleanup hook once
+         * the environment shuts down. The data is kept in a map owned by
+         * this library, so the instance data of the environment stays
+         * free for the addon, e.g. for Napi::Addon.
+         */
+        class env_data {
+        public:
+            /**
+             * Get the data of an environment. Creates it on first use.
+             * Must be called on the javascript thread of the environment.
+             *
+             * @param env the environment
+             * @return the data of the environment
+             */
+            static env_data &get(const Napi::Env &env) {
+                registry &r = registry::instance();
+                std::unique_lock<std::mutex> lock(r.mtx);
+                auto it = r.data.find(env);
+                if (it != r.data.end()) {
+                    return *it->second;
+                }
+
+                auto *d = new env_data(env);
+                if (napi_add_env_cleanup_hook(env, cleanup, d) != napi_ok) {
+                    delete d;
+                    throw std::runtime_error("Could not add the environment cleanup hook");
+                }
+
+                r.data.emplace(env, d);
+                return *d;
+            }
+
+            /**
+             * Get a unique id for a value stored per environment
+             *
+             * @return the id
+             */
+            static size_t next_id() {
+                static std::atomic<size_t> id{0};
+                return id.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // The stored values by their id
+            std::map<size_t, std::shared_ptr<void>> values;
+
+        private:
+            /**
+             * The data of all environments
+             */
+            struct registry {
+                /**
+                 * Get the registry instance. Never destroyed, as
+                 * environments may shut down during static destruction.
+                 *
+                 * @return the registry
+                 */
+                static registry &instance() {
+                    static auto *r = new registry();
+                    return *r;
+                }
+
+                std::mutex mtx;
+                std::unordered_map<napi_env, env_data *> data;
+            };
+
+            explicit env_data(napi_env env) : env(env) {}
+
+            // Called once the environment shuts down
+            static void cleanup(void *arg) {
+                std::unique_ptr<env_data> d(static_cast<env_data *>(arg));
+                registry &r = registry::instance();
+                std::unique_lock<std::mutex> lock(r.mtx);
+                r.data.erase(d->env);
+                lock.unlock();
+
+                // The values are destroyed without holding the lock
+                d.reset();
+            }
+
+            const napi_env env;
+        };
+
+        /**
+         * A value which exists once per environment, e.g. per worker thread.
+         * Replaces static variables which would be shared by all environments.
+         *
+         * @tparam T the type of the value, must be default-constructible
+         */
+        template<class T>
+        class per_env {
+        public:
+            per_env() : id(env_data::next_id()) {}
+
+            per_env(const per_env &) = delete;
+
+            per_env &operator=(const per_env &) = delete;
+
+            /**
+             * Get the value of an environment. Creates it on first use.
+             * Must be called on the javascript thread of the environment.
+             *
+             * @param env the environment
+             * @return the value of the environment
+             */
+            T &get(const Napi::Env &env) {
+                auto &values = env_data::get(env).values;
+                auto it = values.find(id);
+                if (it == values.end()) {
+                    it = values.emplace(id, std::make_shared<T>()).first;
+                }
+
+                return *static_cast<T *>(it->second.get());
+            }
+
+        private:
+            const size_t id;
+        };
+
+        /**
+         * Runs c++ handlers once javascript promises settle.
+         * A single async helper awaiting the promise is created per environment,
+         * the handler of a promise is passed to it as an External, which is the
+         * only state created per promise. No closures are created per promise.
+         */
+        class promise_adopter {
+        public:
+            /**
+             * The handler of a single promise
+             */
+            class handler {
+            public:
+                virtual ~handler() = default;
+
+                /**
+                 * Called on the javascript thread once the promise was fulfilled.
+                 * Must not throw.
+                 *
+                 * @param env the environment to work in
+                 * @param value the value of the promise
+                 */
+                virtual void resolve(const Napi::Env &env, const Napi::Value &value) = 0;
+
+                /**
+                 * Called on the javascript thread once the promise was rejected.
+                 * Must not throw.
+                 *
+                 * @param env the environment to work in
+                 * @param reason the rejection reason
+                 */
+                virtual void reject(const Napi::Env &env, const Napi::Value &reason) = 0;
+            };
+
+            /**
+             * Call a handler once a promise settles.
+             * Must be called on the javascript thread.
+             *
+             * @param env the environment to work in
+             * @param promise the promise to adopt
+             * @param h the handler to call. Deleted once the promise settled.
+             */
+            static void adopt(const Napi::Env &env, const Napi::Value &promise, std::unique_ptr<handler> h) {
+                static per_env<functions> fns;
+                functions &f = fns.get(env);
+                if (f.adopt.IsEmpty()) {
+                    f.init(env);
+                }
+
+                // The handler lives until the promise callbacks are collected
+                handler *ptr = h.release();
+                const auto data = Napi::External<handler>::New(env, ptr, [](Napi::Env, handler *h) {
+                    delete h;
+                });
+
+                f.adopt.Call({promise, data});
+            }
+
+        private:
+            /**
+             * The functions of an environment
+             */
+            struct functions {
+                /**
+                 * Create the functions
+                 *
+                 * @param env the environment to work in
+                 */
+                void init(const Napi::Env &env) {
+                    const auto factory = env.RunScript(
+                            "(resolve, reject) => async (p, h) => {"
+                            " try { resolve(h, await p); } catch (e) { reject(h, e); } }");
+                    const auto resolve = Napi::Function::New(env, [](const Napi::CallbackInfo &info) {
+                        info[0].As<Napi::External<handler>>().Data()->resolve(info.Env(), info[1]);
+                    });
+                    const auto reject = Napi::Function::New(env, [](const Napi::CallbackInfo &info) {
+                        info[0].As<Napi::External<handler>>().Data()->reject(info.Env(), info[1]);
+                    });
+
+                    adopt = Napi::Persistent(factory.As<Napi::Function>().Call({resolve, reject}).As<Napi::Function>());
+                }
+
+                Napi::FunctionReference adopt;
+            };
+        };
+
         /**
          * A namespace for conversions
          */
@@ -351,36 +882,43 @@ namespace napi_tools {
             struct toCpp<std::shared_ptr<std::promise<T>>> {
                 static std::shared_ptr<std::promise<T>> convert(const Napi::Env &env, const Napi::Value &val) {
                     if (!val.IsPromise()) throw std::runtime_error("The value supplied must be a promise");
-                    auto promise = val.As<Napi::Promise>();
-
-                    Napi::Value thenValue = promise.Get("then");
-                    if (!thenValue.IsFunction())
-                        throw std::runtime_error("Promise is not thenable");
-                    auto then = thenValue.As<Napi::Function>();
-
-                    std::shared_ptr<std::promise<T>> cppPromise = std::make_shared<std::promise<T>>();
-                    Napi::Function callback = Napi::Function::New(env, [cppPromise](const Napi::CallbackInfo &info) {
-                        std::cout << "Callback called" << std::endl;
-                        if constexpr (std::is_same_v<T, void>) {
-                            cppPromise->set_value();
-                        } else {
-                            cppPromise->set_value(toCpp<T>::convert(info.Env(), info[0]));
-                        }
-                    });
-
-                    Napi::Function error = Napi::Function::New(env, [cppPromise](const Napi::CallbackInfo &info) {
-                        if (info.Length() > 0) {
-                            cppPromise->set_exception(std::make_exception_ptr(std::runtime_error(info[0].ToString())));
-                        } else {
-                            cppPromise->set_exception(std::make_exception_ptr(std::exception()));
-                        }
-                    });
+                    auto cppPromise = std::make_shared<std::promise<T>>();
 
-                    std::cout << "Calling then" << std::endl;
-                    then.Call(promise, {callback, error});
+                    ::napi_tools::util::promise_adopter::adopt(env, val, std::make_unique<handler>(cppPromise));
                     return cppPromise;
                 }
-            };
+
+            private:
+                /**
+                 * Settles the std::promise once the javascript promise settled
+                 */
+                class handler : public ::napi_tools::util::promise_adopter::handler {
+                public:
+                    explicit handler(std::shared_ptr<std::promise<T>> promise) : promise(std::move(promise)) {}
+
+                    void resolve(const Napi::Env &env, const Napi::Value &value) override {
+                        try {
+                            if constexpr (std::is_same_v<T, void>) {
+                                promise->set_value();
+                            } else {
+                                promise->set_value(toCpp<T>::convert(env, value));
+                            }
+                        } catch (...) {
+                            promise->set_exception(std::current_exception());
+                        }
+                    }
+
+                    void reject(const Napi::Env &, const Napi::Value &reason) override {
+                        try {
+                            promise->set_exception(std::make_exception_ptr(std::runtime_error(
+                                    reason.IsEmpty() ? "The promise was rejected" : reason.ToString().Utf8Value())));
+                        } catch (...) {}
+                    }
+
+                private:
+                    std::shared_ptr<std::promise<T>> promise;
+                };
+            };
 
             /**
              * Convert a Napi::Value to any cpp type
@@ -505,1146 +1043,5503 @@ namespace napi_tools {
 
 #undef slash
 
-    namespace promises {
+#ifdef NAPI_TOOLS_TRACING
+    /**
+     * An opt-in tracing subsystem, enabled by defining NAPI_TOOLS_TRACING.
+     * Spans are recorded into per-thread ring buffers without locks and
+     * can be written as Chrome trace-event JSON, which Perfetto can open.
+     */
+    namespace tracing {
         /**
-         * A class for creating js promises. This class must exist since the original
-         * n-api is so bad and cannot provide such a simple behaviour by default. Also,
-         * the docs on Promises are worth shit, just as a side note. You will need to
-         * look at the examples to find this, why not?
-         *
-         * Source:
-         * https://github.com/nodejs/node-addon-examples/issues/85#issuecomment-583887294
-         * Also exists here:
-         * https://github.com/nodejs/node-addon-examples/blob/master/async_pi_estimate/node-addon-api/async.cc
+         * A recorded event. The fields are atomic, so
+         * events can be read while they are overwritten.
+         */
+        struct event {
+            std::atomic<const char *> category{nullptr};
+            std::atomic<const char *> name{nullptr};
+            // The start time in nanoseconds
+            std::atomic<uint64_t> ts{0};
+            // The duration in nanoseconds, only used by complete events
+            std::atomic<uint64_t> dur{0};
+            // 'X' for complete events, 'i' for instant events
+            std::atomic<char> phase{0};
+            // Odd while the event is being written
+            std::atomic<uint64_t> seq{0};
+        };
+
+        /**
+         * A ring buffer of events written by a single thread
          */
-        class AsyncWorker : public Napi::AsyncWorker {
+        class ring_buffer {
         public:
             /**
-             * Construct a Promise
+             * Create a ring buffer
              *
-             * @param env the environment to work in
-             * @param _fn the function to call
+             * @param tid the id of the thread writing the buffer
              */
-            inline explicit AsyncWorker(const Napi::Env &env) : Napi::AsyncWorker(env),
-                                                                deferred(Napi::Promise::Deferred::New(env)) {
-            }
+            explicit ring_buffer(uint64_t tid) : tid(tid), events(NAPI_TOOLS_TRACING_BUFFER_SIZE) {}
 
             /**
-             * Get the promise
+             * Clear the buffer, so it can be written by another thread.
+             * Must not be called while the buffer is written or read.
              *
-             * @return a Napi::Promise
+             * @param id the id of the new writing thread
              */
-            inline Napi::Promise GetPromise() const {
-                return deferred.Promise();
+            inline void reset(uint64_t id) noexcept {
+                tid = id;
+                head.store(0, std::memory_order_relaxed);
             }
 
-        protected:
-            /**
-             * A default destructor
-             */
-            inline ~AsyncWorker() override = default;
-
-            virtual void Run() = 0;
-
             /**
-             * The execution thread
+             * Record an event. Must only be called by the owning thread.
+             * Overwrites the oldest event if the buffer is full.
+             *
+             * @param category the event category, must be a string literal
+             * @param name the event name, must be a string literal
+             * @param phase the event phase
+             * @param ts the start time in nanoseconds
+             * @param dur the duration in nanoseconds
              */
-            inline void Execute() override {
-                try {
-                    Run();
-#ifdef NAPI_TOOLS_ASYNC_WORKER_SLEEP
-                    std::this_thread::sleep_for(std::chrono::milliseconds(NAPI_TOOLS_ASYNC_WORKER_SLEEP));
-#endif //NAPI_TOOLS_ASYNC_WORKER_SLEEP
-                } catch (std::exception &e) {
-                    Napi::AsyncWorker::SetError(e.what());
-                } catch (...) {
-                    Napi::AsyncWorker::SetError("An unknown error occurred");
-                }
+            inline void record(const char *category, const char *name, char phase, uint64_t ts,
+                               uint64_t dur) noexcept {
+                const uint64_t h = head.load(std::memory_order_relaxed);
+                event &e = events[h % events.size()];
+
+                const uint64_t seq = e.seq.load(std::memory_order_relaxed) + 1;
+                e.seq.store(seq, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                e.category.store(category, std::memory_order_relaxed);
+                e.name.store(name, std::memory_order_relaxed);
+                e.ts.store(ts, std::memory_order_relaxed);
+                e.dur.store(dur, std::memory_order_relaxed);
+                e.phase.store(phase, std::memory_order_relaxed);
+                e.seq.store(seq + 1, std::memory_order_release);
+
+                head.store(h + 1, std::memory_order_release);
             }
 
             /**
-             * Default on ok
+             * Write the events as trace-event JSON objects.
+             * Events being overwritten while reading are skipped.
+             *
+             * @param out the stream to write to
+             * @param first whether no event has been written to the stream yet
              */
-            inline void OnOK() override {
-                deferred.Resolve(Env().Undefined());
+            inline void write(std::ostream &out, bool &first) const {
+                const uint64_t h = head.load(std::memory_order_acquire);
+                const uint64_t count = std::min<uint64_t>(h, events.size());
+                for (uint64_t i = h - count; i < h; i++) {
+                    const event &e = events[i % events.size()];
+                    const uint64_t seq = e.seq.load(std::memory_order_acquire);
+                    const char *category = e.category.load(std::memory_order_relaxed);
+                    const char *name = e.name.load(std::memory_order_relaxed);
+                    const uint64_t ts = e.ts.load(std::memory_order_relaxed);
+                    const uint64_t dur = e.dur.load(std::memory_order_relaxed);
+                    const char phase = e.phase.load(std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if ((seq & 1) != 0 || seq != e.seq.load(std::memory_order_relaxed) || name == nullptr) {
+                        continue;
+                    }
+
+                    out << (first ? "" : ",\n") << R"({"cat":")" << category << R"(","name":")" << name
+                        << R"(","ph":")" << phase << R"(","pid":1,"tid":)" << tid << R"(,"ts":)";
+                    write_micros(out, ts);
+                    if (phase == 'X') {
+                        out << R"(,"dur":)";
+                        write_micros(out, dur);
+                    } else {
+                        out << R"(,"s":"t")";
+                    }
+
+                    out << '}';
+                    first = false;
+                }
             }
 
+        private:
             /**
-             * On error
+             * Write nanoseconds as microseconds without losing precision
              *
-             * @param error the error to throw
+             * @param out the stream to write to
+             * @param ns the nanoseconds to write
              */
-            inline void OnError(const Napi::Error &error) override {
-                deferred.Reject(error.Value());
+            static void write_micros(std::ostream &out, uint64_t ns) {
+                const uint64_t frac = ns % 1000;
+                out << ns / 1000 << '.' << (char) ('0' + frac / 100) << (char) ('0' + frac / 10 % 10)
+                    << (char) ('0' + frac % 10);
             }
 
-            Napi::Promise::Deferred deferred;
+            uint64_t tid;
+            std::vector<event> events;
+            std::atomic<uint64_t> head{0};
         };
 
         /**
-         * A class for creating Promises with return types
-         *
-         * @tparam T the return type of the operation
+         * The registry of all ring buffers. Buffers outlive their threads,
+         * so events of finished threads can still be written. The buffers
+         * of finished threads are reused by new threads once their events
+         * have been written, or if more than NAPI_TOOLS_TRACING_MAX_RETIRED
+         * buffers are waiting to be written.
          */
-        template<typename T>
-        class promiseCreator : public AsyncWorker {
+        class registry {
         public:
             /**
-             * Construct a Promise
+             * Get the registry instance
              *
-             * @param env the environment to work in
-             * @param _fn the function to call
+             * @return the registry
              */
-            inline promiseCreator(const Napi::Env &env, std::function<T()> _fn) : AsyncWorker(env),
-                                                                                  fn(std::move(_fn)) {}
+            static registry &instance() {
+                // Never destroyed, threads may still record while the process exits
+                static auto *reg = new registry();
+                return *reg;
+            }
 
-        protected:
             /**
-             * A default destructor
+             * Get the ring buffer of the calling thread.
+             * Only locks when called for the first time on a thread.
+             *
+             * @return the ring buffer
              */
-            inline ~promiseCreator() override = default;
+            inline ring_buffer &local() {
+                thread_local owner current;
+                if (current.buffer == nullptr) {
+                    current.buffer = acquire();
+                }
+
+                return *current.buffer;
+            }
 
             /**
-             * The execution thread
+             * Write all recorded events as Chrome trace-event JSON
+             *
+             * @param out the stream to write to
              */
-            inline void Run() override {
-                val = fn();
+            inline void write(std::ostream &out) {
+                std::unique_lock<std::mutex> lock(mtx);
+                bool first = true;
+                out << "{\"traceEvents\":[\n";
+                for (const auto &buffer: buffers) {
+                    buffer->write(out, first);
+                }
+
+                out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+
+                // The events of finished threads have been written, their buffers can be reused
+                free.insert(free.end(), retired.begin(), retired.end());
+                retired.clear();
             }
 
+        private:
             /**
-             * On ok
+             * Returns the buffer of a thread to the registry once the thread exits
              */
-            inline void OnOK() override {
-                try {
-                    deferred.Resolve(::napi_tools::util::conversions::cppValToValue(Env(), val));
-                } catch (const std::exception &e) {
-                    deferred.Reject(Napi::Error::New(Env(), e.what()).Value());
-                } catch (...) {
-                    deferred.Reject(Napi::Error::New(Env(), "An unknown error occurred").Value());
+            struct owner {
+                ring_buffer *buffer = nullptr;
+
+                ~owner() {
+                    if (buffer != nullptr) {
+                        registry::instance().release(std::exchange(buffer, nullptr));
+                    }
                 }
             };
 
-        private:
-            std::function<T()> fn;
-            T val;
+            registry() = default;
+
+            /**
+             * Get a buffer for a new thread. Reuses the buffer
+             * of a finished thread, if possible.
+             *
+             * @return the buffer
+             */
+            inline ring_buffer *acquire() {
+                std::unique_lock<std::mutex> lock(mtx);
+                ring_buffer *buffer;
+                if (!free.empty()) {
+                    buffer = free.back();
+                    free.pop_back();
+                } else if (retired.size() >= NAPI_TOOLS_TRACING_MAX_RETIRED) {
+                    // Drop the oldest events which have not been written
+                    buffer = retired.front();
+                    retired.pop_front();
+                } else {
+                    buffers.push_back(std::make_unique<ring_buffer>(0));
+                    buffer = buffers.back().get();
+                }
+
+                buffer->reset(++last_tid);
+                return buffer;
+            }
+
+            /**
+             * Return the buffer of a finished thread
+             *
+             * @param buffer the buffer to return
+             */
+            inline void release(ring_buffer *buffer) {
+                std::unique_lock<std::mutex> lock(mtx);
+                retired.push_back(buffer);
+            }
+
+            std::mutex mtx;
+            std::vector<std::unique_ptr<ring_buffer>> buffers;
+            // The buffers of finished threads whose events have not been written yet
+            std::deque<ring_buffer *> retired;
+            // The buffers of finished threads whose events have been written
+            std::vector<ring_buffer *> free;
+            // The id of the last thread which got a buffer
+            uint64_t last_tid = 0;
         };
 
         /**
-         * A class for creating Promises with no return type
+         * Get the current time in nanoseconds
+         *
+         * @return the current time
          */
-        template<>
-        class promiseCreator<void> : public AsyncWorker {
+        inline uint64_t now() noexcept {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        /**
+         * Record an instant event
+         *
+         * @param category the event category, must be a string literal
+         * @param name the event name, must be a string literal
+         */
+        inline void instant(const char *category, const char *name) noexcept {
+            registry::instance().local().record(category, name, 'i', now(), 0);
+        }
+
+        /**
+         * A span recorded as a complete event once it is destroyed
+         */
+        class span {
         public:
             /**
-             * Construct a Promise
+             * Start a span
              *
-             * @param env the environment to work in
-             * @param _fn the function to call
+             * @param category the span category, must be a string literal
+             * @param name the span name, must be a string literal
              */
-            inline promiseCreator(const Napi::Env &env, std::function<void()> _fn) : AsyncWorker(env),
-                                                                                     fn(std::move(_fn)) {}
+            span(const char *category, const char *name) noexcept: category(category), name(name), start(now()) {}
 
-        protected:
-            /**
-             * A default destructor
-             */
-            inline ~promiseCreator() override = default;
+            span(const span &) = delete;
+
+            span &operator=(const span &) = delete;
 
             /**
-             * The run function
+             * End the span
              */
-            inline void Run() override {
-                fn();
+            ~span() {
+                registry::instance().local().record(category, name, 'X', start, now() - start);
             }
 
         private:
-            std::function<void()> fn;
+            const char *category;
+            const char *name;
+            const uint64_t start;
         };
 
         /**
-         * A class for creating promises
+         * Write all recorded events as Chrome trace-event JSON
          *
-         * @tparam T the return type of the promise
+         * @param out the stream to write to
          */
-        template<class T>
-        class promise {
+        inline void write(std::ostream &out) {
+            registry::instance().write(out);
+        }
+
+        /**
+         * Write all recorded events as Chrome trace-event JSON to a file
+         *
+         * @param path the path of the file to write
+         */
+        inline void write(const std::string &path) {
+            std::ofstream out(path);
+            if (!out) {
+                throw std::runtime_error("Could not open the trace file: " + path);
+            }
+
+            write(out);
+        }
+    } // namespace tracing
+#endif //NAPI_TOOLS_TRACING
+
+    namespace promises {
+        /**
+         * A task run by the promise thread pool
+         */
+        class task {
         public:
+            virtual ~task() = default;
+
             /**
-             * Create a promise
+             * Run the task. Called on a pool thread.
+             * The task must delete itself or pass itself on.
+             */
+            virtual void run() = 0;
+        };
+
+        /**
+         * A process-wide pool of threads running the functions of all promises,
+         * so promises do not compete with fs, dns and zlib for the libuv threadpool.
+         * Every thread has its own queue, idle threads steal tasks from the others.
+         */
+        class thread_pool {
+        public:
+            /**
+             * Get the pool instance. The instance is never destroyed,
+             * as tasks may still run during static destruction.
              *
-             * @param env the environment to run in
-             * @param fn the promise function to call
+             * @return the pool
              */
-            promise(const Napi::Env &env, const std::function<T()> &fn) {
-                pr = new promiseCreator<T>(env, fn);
-                pr->Queue();
+            static thread_pool &instance() {
+                static auto *inst = new thread_pool();
+                return *inst;
             }
 
             /**
-             * Get the Napi::Promise
+             * Set the number of threads. Has no effect once the first task was run.
              *
-             * @return the Napi::Promise
+             * @param count the number of threads. Must be at least one.
+             * @return false, if the pool is already running
              */
-            [[nodiscard]] inline Napi::Promise getPromise() const {
-                return pr->GetPromise();
+            inline bool setThreadCount(size_t count) {
+                std::unique_lock<std::mutex> lock(mtx);
+                if (!queues.empty()) return false;
+
+                thread_count = std::max(count, (size_t) 1);
+                return true;
             }
 
             /**
-             * Get the Napi::Promise
+             * Run a task
              *
-             * @return the Napi::Promise
+             * @param t the task to run
              */
-            [[nodiscard]] inline operator Napi::Promise() const {
-                return this->getPromise();
+            inline void submit(task *t) {
+                std::unique_lock<std::mutex> lock(mtx);
+                if (queues.empty()) {
+                    this->start();
+                }
+
+                // Tasks submitted by a pool thread are run by the same thread, if not stolen
+                const size_t index = current < queues.size() ? current
+                                                             : next.fetch_add(1, std::memory_order_relaxed) % queues.size();
+                worker_queue &q = *queues[index];
+                lock.unlock();
+
+                // Count the task before it can be taken, so pending never wraps.
+                // Threads seeing the count block on q.mtx until the task is queued.
+                std::unique_lock<std::mutex> q_lock(q.mtx);
+                pending.fetch_add(1, std::memory_order_release);
+                q.tasks.push_back(t);
+                q_lock.unlock();
+
+                lock.lock();
+                lock.unlock();
+                cv.notify_one();
             }
 
+        private:
             /**
-             * Get the Napi::Promise as a value
-             *
-             * @return the Napi::Value
+             * The task queue of a thread
              */
-            [[nodiscard]] inline operator Napi::Value() const {
-                return this->getPromise();
+            struct worker_queue {
+                std::mutex mtx;
+                std::deque<task *> tasks;
+            };
+
+            thread_pool() {
+                // hardware_concurrency() returns 0 if the number of cores is unknown
+                thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+            }
+
+            // Create the queues and start the threads. mtx must be locked.
+            inline void start() {
+                for (size_t i = 0; i < thread_count; i++) {
+                    queues.push_back(std::make_unique<worker_queue>());
+                }
+
+                for (size_t i = 0; i < thread_count; i++) {
+                    std::thread(&thread_pool::run, this, i).detach();
+                }
             }
 
             /**
-             * A default destructor
+             * Take a task, from the own queue first and steal from the other queues otherwise.
+             * All queues are taken from the front, so tasks run in the order they were submitted.
+             *
+             * @param index the index of the own queue
+             * @return the task or nullptr if all queues are empty
              */
-            inline ~promise() noexcept = default;
+            inline task *take(size_t index) {
+                {
+                    worker_queue &own = *queues[index];
+                    std::unique_lock<std::mutex> lock(own.mtx);
+                    if (!own.tasks.empty()) {
+                        task *t = own.tasks.front();
+                        own.tasks.pop_front();
+                        return t;
+                    }
+                }
 
-        private:
-            promiseCreator<T> *pr;
+                for (size_t i = 1; i < queues.size(); i++) {
+                    worker_queue &other = *queues[(index + i) % queues.size()];
+                    std::unique_lock<std::mutex> lock(other.mtx);
+                    if (!other.tasks.empty()) {
+                        task *t = other.tasks.front();
+                        other.tasks.pop_front();
+                        return t;
+                    }
+                }
+
+                return nullptr;
+            }
+
+            // The pool thread entry
+            void run(size_t index) {
+                current = index;
+                while (true) {
+                    if (task *t = this->take(index)) {
+                        pending.fetch_sub(1, std::memory_order_relaxed);
+                        t->run();
+                    } else {
+                        std::unique_lock<std::mutex> lock(mtx);
+                        cv.wait(lock, [this] {
+                            return pending.load(std::memory_order_acquire) > 0;
+                        });
+                    }
+                }
+            }
+
+            std::mutex mtx;
+            std::condition_variable cv;
+            // The queues of the threads. Never changed once the pool is running.
+            std::vector<std::unique_ptr<worker_queue>> queues;
+            // The number of queued tasks
+            std::atomic<size_t> pending{0};
+            // The queue to submit the next task from a non-pool thread to
+            std::atomic<size_t> next{0};
+            // The number of threads to start
+            size_t thread_count;
+            // The queue index of the current thread, if it is a pool thread
+            static inline thread_local size_t current = std::numeric_limits<size_t>::max();
         };
 
         /**
-         * A class for creating void promises
+         * Delivers the results of finished promise tasks to the javascript
+         * thread of an environment using a single thread-safe function
          */
-        template<>
-        class promise<void> {
+        class completion_queue {
         public:
             /**
-             * Create a promise
+             * A finished task to be completed on the javascript thread
+             */
+            class completion {
+            public:
+                virtual ~completion() = default;
+
+                /**
+                 * Resolve or reject the promise. Called on the javascript thread.
+                 *
+                 * @param env the environment to work in
+                 */
+                virtual void complete(const Napi::Env &env) = 0;
+            };
+
+            /**
+             * Get the queue of an environment. Must be called on the javascript thread.
              *
-             * @param env the environment to run in
-             * @param fn the promise function to call
+             * @param env the environment
+             * @return the queue
              */
-            inline promise(const Napi::Env &env, const std::function<void()> &fn) {
-                pr = new promiseCreator<void>(env, fn);
-                pr->Queue();
+            static const std::shared_ptr<completion_queue> &get(const Napi::Env &env) {
+                static ::napi_tools::util::per_env<std::shared_ptr<completion_queue>> queues;
+                std::shared_ptr<completion_queue> &q = queues.get(env);
+                if (!q) {
+                    q = std::make_shared<completion_queue>();
+                    q->ts_fn = Napi::ThreadSafeFunction::New(env, Napi::Function::New(env, [](const Napi::CallbackInfo &) {}),
+                                                             "napi_tools::promise", 0, 1,
+                                                             new std::shared_ptr<completion_queue>(q), FinalizerCallback,
+                                                             (void *) nullptr);
+                    q->ts_fn.Unref(env);
+                }
+
+                return q;
             }
 
             /**
-             * Get the Napi::Promise
+             * Register a new task. Keeps the process alive until it was completed.
+             * Called on the javascript thread.
              *
-             * @return the Napi::Promise
+             * @param env the environment to work in
              */
-            [[nodiscard]] inline Napi::Promise getPromise() const {
-                return pr->GetPromise();
+            void started(const Napi::Env &env) {
+                if (running++ == 0) {
+                    ts_fn.Ref(env);
+                }
             }
 
             /**
-             * Get the Napi::Promise
+             * Pass a finished task to the javascript thread. Called on any thread.
              *
-             * @return the Napi::Promise
+             * @param c the finished task
              */
-            [[nodiscard]] inline operator Napi::Promise() const {
-                return this->getPromise();
+            void push(std::unique_ptr<completion> c) {
+                std::unique_lock<std::mutex> lock(mtx);
+                if (closed) return;
+
+                finished.push_back(std::move(c));
+                if (!scheduled) {
+                    scheduled = ts_fn.NonBlockingCall(this, [](Napi::Env env, Napi::Function, completion_queue *q) {
+                        q->completeAll(env);
+                    }) == napi_ok;
+                }
             }
 
+        private:
             /**
-             * Get the Napi::Promise as a value
+             * Complete all finished tasks. Called on the javascript thread.
              *
-             * @return the Napi::Value
+             * @param env the environment to work in
              */
-            [[nodiscard]] inline operator Napi::Value() const {
-                return this->getPromise();
+            void completeAll(const Napi::Env &env) {
+                std::unique_lock<std::mutex> lock(mtx);
+                std::vector<std::unique_ptr<completion>> done;
+                done.swap(finished);
+                scheduled = false;
+                lock.unlock();
+
+                for (const auto &c: done) {
+                    Napi::HandleScope scope(env);
+                    c->complete(env);
+                }
+
+                running -= done.size();
+                if (running == 0 && !done.empty()) {
+                    ts_fn.Unref(env);
+                }
             }
 
             /**
-             * A default destructor
+             * Called once the environment shut down
+             *
+             * @param ctx the queue
              */
-            inline ~promise() noexcept = default;
+            static void FinalizerCallback(Napi::Env, void *, std::shared_ptr<completion_queue> *ctx) {
+                std::unique_ptr<std::shared_ptr<completion_queue>> q(ctx);
+                std::unique_lock<std::mutex> lock((*q)->mtx);
+                (*q)->closed = true;
+                (*q)->finished.clear();
+            }
 
-        private:
-            promiseCreator<void> *pr;
+            std::mutex mtx;
+            std::vector<std::unique_ptr<completion>> finished;
+            // Whether completeAll was scheduled already
+            bool scheduled = false;
+            // Set once the environment shut down
+            bool closed = false;
+            Napi::ThreadSafeFunction ts_fn;
+            // The number of tasks not yet completed. Only accessed on the javascript thread.
+            size_t running = 0;
         };
-    } // namespace promises
-
-    /**
-     * A namespace for callbacks
-     */
-    namespace callbacks {
-        using error_func = std::function<void(::napi_tools::exception)>;
 
         /**
-         * Utility namespace
+         * A promise function run by the thread pool
+         *
+         * @tparam T the return type of the function
          */
-        namespace util {
-            template<class...Args>
-            using converter_func = std::function<std::vector<napi_value>(const Napi::Env &, Args...)>;
+        template<class T>
+        class pool_task : public task, public completion_queue::completion {
+        public:
+            /**
+             * Create a task
+             *
+             * @param env the environment to work in
+             * @param fn the function to run
+             */
+            pool_task(const Napi::Env &env, std::function<T()> fn)
+                    : deferred(Napi::Promise::Deferred::New(env)), queue(completion_queue::get(env)),
+                      fn(std::move(fn)) {}
 
             /**
-             * The callback template
+             * Queue a task
              *
-             * @tparam T the javascriptCallback class type
+             * @param env the environment to work in
+             * @param fn the function to run
+             * @return the promise resolved with the result of the function
              */
-            template<class T, class...Args>
-            class callback_template {
-            public:
-                /**
-                 * Construct an empty callback function.
-                 * Will throw an exception when trying to call.
-                 */
-                callback_template() noexcept: ptr(nullptr) {}
+            static Napi::Promise queue_task(const Napi::Env &env, std::function<T()> fn) {
+                auto *t = new pool_task<T>(env, std::move(fn));
+                const Napi::Promise promise = t->deferred.Promise();
+                t->queue->started(env);
+                thread_pool::instance().submit(t);
 
-                /**
-                 * Construct an empty callback function.
-                 * Will throw an exception when trying to call.
-                 */
-                callback_template(std::nullptr_t) noexcept: ptr(nullptr) {}
+                return promise;
+            }
 
-                /**
+            /**
+             * Run the function and pass the result to the javascript thread
+             */
+            void run() override {
+                {
+                    NAPI_TOOLS_TRACE_SPAN("promise", "Execute");
+                    try {
+                        if constexpr (std::is_void_v<T>) {
+                            fn();
+                        } else {
+                            val.emplace(fn());
+                        }
+                    } catch (const std::exception &e) {
+                        error.emplace(e.what());
+                    } catch (...) {
+                        error.emplace("An unknown error occurred");
+                    }
+                }
+
+                // The task is deleted once it was completed on the javascript thread
+                const std::shared_ptr<completion_queue> q = queue;
+                q->push(std::unique_ptr<completion_queue::completion>(this));
+            }
+
+            /**
+             * Resolve or reject the promise
+             *
+             * @param env the environment to work in
+             */
+            void complete(const Napi::Env &env) override {
+                NAPI_TOOLS_TRACE_SPAN("promise", "OnOK");
+                if (error) {
+                    deferred.Reject(Napi::Error::New(env, *error).Value());
+                    return;
+                }
+
+                try {
+                    if constexpr (std::is_void_v<T>) {
+                        deferred.Resolve(env.Undefined());
+                    } else {
+                        deferred.Resolve(::napi_tools::util::conversions::cppValToValue(env, *val));
+                    }
+                } catch (const std::exception &e) {
+                    deferred.Reject(Napi::Error::New(env, e.what()).Value());
+                } catch (...) {
+                    deferred.Reject(Napi::Error::New(env, "An unknown error occurred").Value());
+                }
+            }
+
+        private:
+            Napi::Promise::Deferred deferred;
+            std::shared_ptr<completion_queue> queue;
+            std::function<T()> fn;
+            std::optional<std::conditional_t<std::is_void_v<T>, char, T>> val;
+            std::optional<std::string> error;
+        };
+
+        /**
+         * Set the number of threads running the functions of promises.
+         * Defaults to the number of cores.
+         * Must be called before the first promise is created, e.g. in the init method.
+         *
+         * @param count the number of threads
+         * @return false, if the pool is already running and the count was not changed
+         */
+        inline bool setThreadPoolSize(size_t count) {
+            return thread_pool::instance().setThreadCount(count);
+        }
+
+        /**
+         * A class for creating promises
+         *
+         * @tparam T the return type of the promise
+         */
+        template<class T>
+        class promise {
+        public:
+            /**
+             * Create a promise
+             *
+             * @param env the environment to run in
+             * @param fn the promise function to call
+             */
+            promise(const Napi::Env &env, const std::function<T()> &fn) {
+                NAPI_TOOLS_TRACE_SPAN("promise", "queue");
+                pr = pool_task<T>::queue_task(env, fn);
+            }
+
+            /**
+             * Get the Napi::Promise
+             *
+             * @return the Napi::Promise
+             */
+            [[nodiscard]] inline Napi::Promise getPromise() const {
+                return pr;
+            }
+
+            /**
+             * Get the Napi::Promise
+             *
+             * @return the Napi::Promise
+             */
+            [[nodiscard]] inline operator Napi::Promise() const {
+                return this->getPromise();
+            }
+
+            /**
+             * Get the Napi::Promise as a value
+             *
+             * @return the Napi::Value
+             */
+            [[nodiscard]] inline operator Napi::Value() const {
+                return this->getPromise();
+            }
+
+            /**
+             * A default destructor
+             */
+            inline ~promise() noexcept = default;
+
+        private:
+            Napi::Promise pr;
+        };
+
+        /**
+         * A class for creating void promises
+         */
+        template<>
+        class promise<void> {
+        public:
+            /**
+             * Create a promise
+             *
+             * @param env the environment to run in
+             * @param fn the promise function to call
+             */
+            inline promise(const Napi::Env &env, const std::function<void()> &fn) {
+                NAPI_TOOLS_TRACE_SPAN("promise", "queue");
+                pr = pool_task<void>::queue_task(env, fn);
+            }
+
+            /**
+             * Get the Napi::Promise
+             *
+             * @return the Napi::Promise
+             */
+            [[nodiscard]] inline Napi::Promise getPromise() const {
+                return pr;
+            }
+
+            /**
+             * Get the Napi::Promise
+             *
+             * @return the Napi::Promise
+             */
+            [[nodiscard]] inline operator Napi::Promise() const {
+                return this->getPromise();
+            }
+
+            /**
+             * Get the Napi::Promise as a value
+             *
+             * @return the Napi::Value
+             */
+            [[nodiscard]] inline operator Napi::Value() const {
+                return this->getPromise();
+            }
+
+            /**
+             * A default destructor
+             */
+            inline ~promise() noexcept = default;
+
+        private:
+            Napi::Promise pr;
+        };
+    } // namespace promises
+
+    /**
+     * A namespace for callbacks
+     */
+    namespace callbacks {
+        using error_func = std::function<void(::napi_tools::exception)>;
+
+        /**
+         * What to do if a call is made while the queue of a callback is full
+         */
+        enum class overflow_policy {
+            // Block the calling thread until there is space in the queue
+            block,
+            // Discard the oldest call which has not been dispatched yet
+            drop_oldest,
+            // Discard the new call
+            drop_newest,
+            // Pass an error to the error function of the new call
+            fail
+        };
+
+        /**
+         * How the dispatcher hands calls to the ThreadSafeFunction
+         */
+        enum class dispatch_mode {
+            // Wait for space in the ThreadSafeFunction queue
+            blocking,
+            // Fail the calls if the ThreadSafeFunction queue is full
+            non_blocking
+        };
+
+#ifdef NAPI_TOOLS_COROUTINES
+        /**
+         * A function resuming a coroutine awaiting a javascript call.
+         * If empty, the coroutine is resumed on the javascript thread.
+         */
+        using executor = std::function<void(std::coroutine_handle<>)>;
+#endif //NAPI_TOOLS_COROUTINES
+
+        /**
+         * What to do with queued calls if a callback is stopped
+         */
+        enum class shutdown_policy {
+            // Deliver the queued calls before releasing the function
+            drain,
+            // Pass an error to the error functions of the queued calls
+            discard
+        };
+
+        /**
+         * Options for dispatching calls to a javascript callback
+         */
+        struct options {
+            /**
+             * The maximum number of queued calls to deliver in a single
+             * ThreadSafeFunction call. 1 disables batching.
+             */
+            size_t max_batch_size = 1;
+
+            /**
+             * The maximum time to wait for a batch to fill up before it is dispatched.
+             * Only used if max_batch_size is greater than 1.
+             */
+            std::chrono::microseconds max_linger{0};
+
+            /**
+             * The maximum number of calls which are queued or waiting to
+             * be run on the js thread. 0 means the queue is unbounded.
+             */
+            size_t capacity = 0;
+
+            /**
+             * What to do if the queue is full. The error functions of dropped
+             * calls are called with an exception.
+             * Blocking must not be used on the js thread, as it would deadlock.
+             */
+            overflow_policy policy = overflow_policy::block;
+
+            /**
+             * Whether a new call replaces a queued call which has not been dispatched yet.
+             * If a key function is set using setCoalescingKey(), only calls with the same
+             * key replace each other. Otherwise, at most one call is queued at any time.
+             * The error functions of replaced calls are called with an exception.
+             */
+            bool coalesce = false;
+
+            /**
+             * How calls are handed to the ThreadSafeFunction. If calls are made
+             * using NonBlockingCall, calls which cannot be delivered because the
+             * ThreadSafeFunction queue is full or closing are passed an error instead.
+             */
+            dispatch_mode mode = dispatch_mode::blocking;
+
+            /**
+             * The maximum number of batches in the ThreadSafeFunction queue.
+             * 0 means the queue is unbounded. In blocking mode, a full queue
+             * blocks a dispatcher thread and thus delays all other callbacks.
+             */
+            size_t thread_safe_queue_size = 0;
+
+            /**
+             * Whether calls made on the javascript thread call the function
+             * directly instead of queueing them. Direct calls complete before
+             * the call returns, thus callSync can be used on the javascript thread.
+             * A promise returned by a direct call is not awaited. Direct calls
+             * bypass the capacity, coalescing, batching and the call order.
+             */
+            bool direct_calls = false;
+
+            /**
+             * What to do with queued calls if the callback is stopped.
+             * Queued calls are always discarded if the environment shuts down.
+             */
+            shutdown_policy on_stop = shutdown_policy::drain;
+        };
+
+        /**
+         * The context of a call. Calls are skipped and their error
+         * functions are called if the context is cancelled or the
+         * deadline passed before the javascript function is called.
+         */
+        struct call_context {
+            using clock = std::chrono::steady_clock;
+
+            /**
+             * Create an empty context. The call is never cancelled.
+             */
+            call_context() = default;
+
+            /**
+             * Create a context from a stop token
+             *
+             * @param token the token cancelling the call
+             */
+            call_context(std::stop_token token) noexcept: token(std::move(token)) {}
+
+            /**
+             * Create a context with a deadline
+             *
+             * @param deadline the time the call must be made before
+             */
+            call_context(clock::time_point deadline) noexcept: deadline(deadline) {}
+
+            /**
+             * Create a context with a timeout
+             *
+             * @param timeout the time from now the call must be made in
+             */
+            template<class Rep, class Period>
+            call_context(std::chrono::duration<Rep, Period> timeout)
+                    : deadline(clock::now() + std::chrono::duration_cast<clock::duration>(timeout)) {}
+
+            /**
+             * Create a context with a stop token and a deadline
+             *
+             * @param token the token cancelling the call
+             * @param deadline the time the call must be made before
+             */
+            call_context(std::stop_token token, clock::time_point deadline) noexcept
+                    : token(std::move(token)), deadline(deadline) {}
+
+            /**
+             * Check if the call was cancelled
+             *
+             * @return true, if the call was cancelled
+             */
+            [[nodiscard]] inline bool cancelled() const noexcept {
+                return token.stop_requested();
+            }
+
+            /**
+             * Check if the call has a deadline
+             *
+             * @return true, if a deadline is set
+             */
+            [[nodiscard]] inline bool has_deadline() const noexcept {
+                return deadline != clock::time_point::max();
+            }
+
+            /**
+             * Check if the deadline passed
+             *
+             * @return true, if the deadline passed
+             */
+            [[nodiscard]] inline bool expired() const noexcept {
+                return has_deadline() && clock::now() >= deadline;
+            }
+
+            // The token cancelling the call
+            std::stop_token token;
+            // The time the call must be made before
+            clock::time_point deadline = clock::time_point::max();
+        };
+
+        /**
+         * A snapshot of a log-linear histogram. Each power of two is
+         * split into sub-buckets, values are accurate to 12.5%.
+         */
+        struct histogram_snapshot {
+            // The number of sub-buckets per power of two, as a power of two
+            static constexpr unsigned sub_bucket_bits = 3;
+            static constexpr size_t sub_buckets = size_t(1) << sub_bucket_bits;
+            static constexpr size_t bucket_count = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+            /**
+             * Get the index of the bucket a value is counted in
+             *
+             * @param value the value
+             * @return the index of the bucket
+             */
+            [[nodiscard]] static constexpr size_t bucket_index(uint64_t value) noexcept {
+                if (value < sub_buckets) return static_cast<size_t>(value);
+
+                const unsigned shift = static_cast<unsigned>(std::bit_width(value)) - 1 - sub_bucket_bits;
+                return (shift + 1) * sub_buckets + static_cast<size_t>((value >> shift) & (sub_buckets - 1));
+            }
+
+            /**
+             * Get the largest value counted in a bucket
+             *
+             * @param index the index of the bucket
+             * @return the largest value of the bucket
+             */
+            [[nodiscard]] static constexpr uint64_t bucket_upper_bound(size_t index) noexcept {
+                if (index < sub_buckets) return index;
+
+                const size_t shift = index / sub_buckets - 1;
+                const uint64_t lower = static_cast<uint64_t>(sub_buckets + index % sub_buckets) << shift;
+                return lower + ((uint64_t(1) << shift) - 1);
+            }
+
+            /**
+             * Get the mean of the recorded values
+             *
+             * @return the mean
+             */
+            [[nodiscard]] inline double mean() const {
+                return count == 0 ? 0.0 : (double) sum / (double) count;
+            }
+
+            /**
+             * Get a percentile of the recorded values
+             *
+             * @param p the percentile, between 0 and 100
+             * @return the value at the percentile, accurate to the bucket size
+             */
+            [[nodiscard]] inline uint64_t percentile(double p) const {
+                if (count == 0 || buckets.empty()) return 0;
+
+                const auto target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p / 100.0 * (double) count)));
+                uint64_t seen = 0;
+                for (size_t i = 0; i < buckets.size(); i++) {
+                    seen += buckets[i];
+                    if (seen >= target) {
+                        return std::min(bucket_upper_bound(i), max);
+                    }
+                }
+
+                return max;
+            }
+
+            /**
+             * Convert the histogram to a javascript object with the
+             * count, mean, max and the 50th, 90th, 99th and 99.9th percentiles
+             *
+             * @param env the environment to work in
+             * @param h the histogram to convert
+             * @return the javascript object
+             */
+            static Napi::Value toNapiValue(const Napi::Env &env, const histogram_snapshot &h) {
+                Napi::Object obj = Napi::Object::New(env);
+                obj.Set("count", Napi::Number::New(env, (double) h.count));
+                obj.Set("mean", Napi::Number::New(env, h.mean()));
+                obj.Set("max", Napi::Number::New(env, (double) h.max));
+                obj.Set("p50", Napi::Number::New(env, (double) h.percentile(50)));
+                obj.Set("p90", Napi::Number::New(env, (double) h.percentile(90)));
+                obj.Set("p99", Napi::Number::New(env, (double) h.percentile(99)));
+                obj.Set("p999", Napi::Number::New(env, (double) h.percentile(99.9)));
+
+                return obj;
+            }
+
+            // The number of recorded values
+            uint64_t count = 0;
+            // The sum of the recorded values
+            uint64_t sum = 0;
+            // The largest recorded value
+            uint64_t max = 0;
+            // The number of values per bucket
+            std::vector<uint64_t> buckets;
+        };
+
+        /**
+         * A snapshot of the statistics of a javascript callback
+         */
+        struct callback_stats {
+            // The number of calls delivered to the js thread
+            uint64_t calls = 0;
+            // The number of ThreadSafeFunction calls used to deliver the calls
+            uint64_t batches = 0;
+            // The largest batch delivered
+            uint64_t max_batch_size = 0;
+            // The number of calls discarded because the queue was full
+            uint64_t dropped = 0;
+            // The number of calls which blocked because the queue was full
+            uint64_t blocked = 0;
+            // The number of calls failed because the queue was full
+            uint64_t failed = 0;
+            // The number of queued calls replaced by newer calls
+            uint64_t coalesced = 0;
+            // The number of calls which could not be handed to the ThreadSafeFunction
+            uint64_t rejected = 0;
+            // The number of calls made directly on the js thread
+            uint64_t direct = 0;
+            // The number of calls skipped because they were cancelled
+            uint64_t cancelled = 0;
+            // The number of calls skipped because their deadline passed
+            uint64_t timed_out = 0;
+            // The number of calls which failed on the js thread
+            uint64_t errors = 0;
+            // The largest number of calls queued at once
+            uint64_t queue_high_water = 0;
+            // The number of calls delivered per second since the callback was created
+            double calls_per_second = 0;
+            // The time in nanoseconds between queueing a call and starting it on the js thread
+            histogram_snapshot queue_latency;
+            // The time in nanoseconds spent running the javascript function
+            histogram_snapshot js_time;
+            // The time in nanoseconds spent converting the arguments and the result
+            histogram_snapshot conversion_time;
+
+            /**
+             * Get the average batch size
+             *
+             * @return the average number of calls per batch
+             */
+            [[nodiscard]] inline double average_batch_size() const {
+                return batches == 0 ? 0.0 : (double) calls / (double) batches;
+            }
+
+            /**
+             * Convert the statistics to a javascript object
+             *
+             * @param env the environment to work in
+             * @param stats the statistics to convert
+             * @return the javascript object
+             */
+            static Napi::Value toNapiValue(const Napi::Env &env, const callback_stats &stats) {
+                Napi::Object obj = Napi::Object::New(env);
+                obj.Set("calls", Napi::Number::New(env, (double) stats.calls));
+                obj.Set("batches", Napi::Number::New(env, (double) stats.batches));
+                obj.Set("maxBatchSize", Napi::Number::New(env, (double) stats.max_batch_size));
+                obj.Set("averageBatchSize", Napi::Number::New(env, stats.average_batch_size()));
+                obj.Set("dropped", Napi::Number::New(env, (double) stats.dropped));
+                obj.Set("blocked", Napi::Number::New(env, (double) stats.blocked));
+                obj.Set("failed", Napi::Number::New(env, (double) stats.failed));
+                obj.Set("coalesced", Napi::Number::New(env, (double) stats.coalesced));
+                obj.Set("rejected", Napi::Number::New(env, (double) stats.rejected));
+                obj.Set("direct", Napi::Number::New(env, (double) stats.direct));
+                obj.Set("cancelled", Napi::Number::New(env, (double) stats.cancelled));
+                obj.Set("timedOut", Napi::Number::New(env, (double) stats.timed_out));
+                obj.Set("errors", Napi::Number::New(env, (double) stats.errors));
+                obj.Set("queueHighWater", Napi::Number::New(env, (double) stats.queue_high_water));
+                obj.Set("callsPerSecond", Napi::Number::New(env, stats.calls_per_second));
+                obj.Set("queueLatency", histogram_snapshot::toNapiValue(env, stats.queue_latency));
+                obj.Set("jsTime", histogram_snapshot::toNapiValue(env, stats.js_time));
+                obj.Set("conversionTime", histogram_snapshot::toNapiValue(env, stats.conversion_time));
+
+                return obj;
+            }
+        };
+
+        /**
+         * Utility namespace
+         */
+        namespace util {
+            template<class...Args>
+            using converter_func = std::function<std::vector<napi_value>(const Napi::Env &, Args...)>;
+
+            /**
+             * A type conversion function filling a fixed-size span of values
+             * instead of returning a std::vector
+             */
+            template<class...Args>
+            using span_converter_func = std::function<void(const Napi::Env &, std::span<napi_value, sizeof...(Args)>,
+                                                           Args...)>;
+
+            /**
+             * An optional custom type conversion function.
+             * May be constructed from a converter_func or a span_converter_func.
+             */
+            template<class...Args>
+            class converter {
+            public:
+                /**
+                 * Create an empty converter. The default conversions will be used.
+                 */
+                converter(std::nullptr_t = nullptr) noexcept {}
+
+                /**
+                 * Create a converter from a function returning a std::vector
+                 *
+                 * @param fn the conversion function
+                 */
+                template<class F, std::enable_if_t<!std::is_same_v<std::decay_t<F>, std::nullptr_t> &&
+                                                   !std::is_same_v<std::decay_t<F>, converter> &&
+                                                   std::is_constructible_v<converter_func<Args...>, F>, int> = 0>
+                converter(F &&fn) : to_vector(std::forward<F>(fn)) {}
+
+                /**
+                 * Create a converter from a function filling a fixed-size span
+                 *
+                 * @param fn the conversion function
+                 */
+                template<class F, std::enable_if_t<!std::is_same_v<std::decay_t<F>, std::nullptr_t> &&
+                                                   !std::is_same_v<std::decay_t<F>, converter> &&
+                                                   !std::is_constructible_v<converter_func<Args...>, F> &&
+                                                   std::is_constructible_v<span_converter_func<Args...>, F>, int> = 0>
+                converter(F &&fn) : to_span(std::forward<F>(fn)) {}
+
+                /**
+                 * Check if a conversion function is set
+                 *
+                 * @return true, if a conversion function is set
+                 */
+                [[nodiscard]] inline explicit operator bool() const noexcept {
+                    return to_vector || to_span;
+                }
+
+                converter_func<Args...> to_vector;
+                span_converter_func<Args...> to_span;
+            };
+
+            /**
+             * A function returning the key of a call, used to coalesce calls
+             */
+            template<class...Args>
+            using key_func = std::function<size_t(const Args &...)>;
+
+            /**
+             * The function to pass the result or the error of a call with return type R to.
+             * Either the result or the error pointer is set.
+             */
+            template<class R>
+            struct completion {
+                using type = ::napi_tools::util::unique_function<void(R *, const ::napi_tools::exception *)>;
+            };
+
+            /**
+             * The function to pass the error of a void call to.
+             * The error is nullptr if the call succeeded.
+             */
+            template<>
+            struct completion<void> {
+                using type = ::napi_tools::util::unique_function<void(const ::napi_tools::exception *)>;
+            };
+
+            template<class R>
+            using completion_t = typename completion<R>::type;
+
+            /**
+             * Pass an error to a completion function
+             *
+             * @tparam R the return type of the call
+             * @param fn the completion function
+             * @param ex the error to pass
+             */
+            template<class R>
+            inline void complete_with_error(completion_t<R> &fn, const ::napi_tools::exception &ex) {
+                if constexpr (std::is_void_v<R>) {
+                    fn(&ex);
+                } else {
+                    fn(nullptr, &ex);
+                }
+            }
+
+            /**
+             * Check if a type is a std::shared_ptr<std::promise<T>>
+             */
+            template<class>
+            struct is_promise_ptr : std::false_type {
+            };
+
+            template<class T>
+            struct is_promise_ptr<std::shared_ptr<std::promise<T>>> : std::true_type {
+            };
+
+            template<class T>
+            inline constexpr bool is_promise_ptr_v = is_promise_ptr<T>::value;
+
+            /**
+             * Create a completion function from a callback and an error function.
+             * Both functions are stored in the completion function without being type-erased.
+             *
+             * @tparam R the return type of the call
+             * @param callback the function to pass the result to
+             * @param on_error the function to pass errors to
+             * @return the completion function
+             */
+            template<class R, class F, class E>
+            inline completion_t<R> make_completion(F &&callback, E &&on_error) {
+                if constexpr (std::is_void_v<R>) {
+                    return [cb = std::forward<F>(callback), err = std::forward<E>(on_error)]
+                            (const ::napi_tools::exception *ex) mutable {
+                        if (ex) {
+                            err(*ex);
+                        } else {
+                            cb();
+                        }
+                    };
+                } else {
+                    return [cb = std::forward<F>(callback), err = std::forward<E>(on_error)]
+                            (R *val, const ::napi_tools::exception *ex) mutable {
+                        if (ex) {
+                            err(*ex);
+                        } else {
+                            cb(std::move(*val));
+                        }
+                    };
+                }
+            }
+
+            /**
+             * Check if a callable is empty, e.g. an empty std::function
+             *
+             * @param f the callable to check
+             * @return true, if the callable is empty
+             */
+            template<class F>
+            inline bool is_empty(const F &f) {
+                using T = std::decay_t<F>;
+                if constexpr (std::is_pointer_v<T> || std::is_member_pointer_v<T> ||
+                              ::napi_tools::util::is_std_function<T>::value) {
+                    return !f;
+                } else {
+                    return false;
+                }
+            }
+
+            class dispatcher;
+
+            /**
+             * Something the dispatcher can run
+             */
+            class dispatch_target {
+            public:
+                /**
+                 * Dispatch all pending work. Called on a dispatcher thread.
+                 * Never called concurrently for the same target.
+                 *
+                 * @return false, if the target is finished and must not be touched by the dispatcher anymore
+                 */
+                virtual bool dispatch() = 0;
+
+            protected:
+                ~dispatch_target() = default;
+
+                // The target itself, set once it is owned by a shared_ptr.
+                // The dispatcher holds a strong reference while the target is scheduled.
+                std::weak_ptr<dispatch_target> weak_target;
+
+            private:
+                friend class dispatcher;
+
+                // The dispatcher state of this target, guarded by the dispatcher mutex.
+                // The reference held while the target is scheduled or running
+                std::shared_ptr<dispatch_target> hold;
+                // Whether dispatch() returned false. The target is never scheduled again.
+                bool finished = false;
+                // Whether this target is in the ready queue
+                bool queued = false;
+                // Whether dispatch() is currently running
+                bool running = false;
+                // Whether dispatch() must run again once it returned
+                bool rerun = false;
+                // Whether this target is in the timer list
+                bool timed = false;
+                // The time to dispatch this target at, if timed is true
+                std::chrono::steady_clock::time_point time;
+                // The next target in the ready queue or the timer list.
+                // The lists are intrusive so scheduling never allocates.
+                dispatch_target *next = nullptr;
+            };
+
+            /**
+             * A process-wide pool of threads dispatching the queued
+             * calls of all javascript callbacks. The threads only wake up
+             * if a callback has work to do.
+             */
+            class dispatcher {
+            public:
+                /**
+                 * Get the dispatcher instance. The instance is never destroyed,
+                 * as callbacks may still be dispatched during static destruction.
+                 *
+                 * @return the dispatcher
+                 */
+                static dispatcher &instance() {
+                    static auto *inst = new dispatcher();
+                    return *inst;
+                }
+
+                /**
+                 * Set the number of dispatcher threads
+                 *
+                 * @param count the number of threads. Must be at least one.
+                 */
+                inline void setThreadCount(size_t count) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    target_threads = std::max(count, (size_t) 1);
+                    lock.unlock();
+
+                    // Wake up all threads, so surplus threads can exit
+                    cv.notify_all();
+                }
+
+                /**
+                 * Schedule a target to be dispatched as soon as possible.
+                 * Does nothing if the target is finished.
+                 *
+                 * @param t the target to dispatch
+                 */
+                inline void schedule(dispatch_target *t) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if (!acquire(t)) return;
+                    if (t->timed) {
+                        remove_timer(t);
+                    }
+
+                    make_ready(t);
+                    start_threads();
+                    lock.unlock();
+                    cv.notify_one();
+                }
+
+                /**
+                 * Schedule a target to be dispatched at a point in time.
+                 * Does nothing if the target is already scheduled or finished.
+                 *
+                 * @param t the target to dispatch
+                 * @param time the time to dispatch the target at
+                 */
+                inline void schedule_at(dispatch_target *t, std::chrono::steady_clock::time_point time) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if (t->queued || t->timed || !acquire(t)) return;
+
+                    // Insert the target into the timer list, which is sorted by time
+                    dispatch_target **pos = &timers;
+                    while (*pos && (*pos)->time <= time) {
+                        pos = &(*pos)->next;
+                    }
+
+                    t->time = time;
+                    t->timed = true;
+                    t->next = *pos;
+                    *pos = t;
+
+                    start_threads();
+                    lock.unlock();
+
+                    // Wake up a thread to update its wait deadline
+                    cv.notify_one();
+                }
+
+            private:
+                dispatcher() = default;
+
+                // Take a strong reference to a target before it is scheduled.
+                // Returns false if the target is finished. mtx must be locked.
+                static inline bool acquire(dispatch_target *t) {
+                    if (t->finished) return false;
+                    if (!t->hold) {
+                        t->hold = t->weak_target.lock();
+                    }
+
+                    return t->hold != nullptr;
+                }
+
+                // Put a target into the ready queue. mtx must be locked.
+                inline void make_ready(dispatch_target *t) {
+                    if (t->running) {
+                        t->rerun = true;
+                    } else if (!t->queued) {
+                        t->queued = true;
+                        t->next = nullptr;
+                        if (ready_tail) {
+                            ready_tail->next = t;
+                        } else {
+                            ready = t;
+                        }
+
+                        ready_tail = t;
+                    }
+                }
+
+                // Remove a target from the timer list. mtx must be locked.
+                inline void remove_timer(dispatch_target *t) {
+                    dispatch_target **pos = &timers;
+                    while (*pos != t) {
+                        pos = &(*pos)->next;
+                    }
+
+                    *pos = t->next;
+                    t->next = nullptr;
+                    t->timed = false;
+                }
+
+                // Start threads until there are target_threads threads. mtx must be locked.
+                inline void start_threads() {
+                    while (threads < target_threads) {
+                        threads++;
+                        std::thread(&dispatcher::run, this).detach();
+                    }
+                }
+
+                // The dispatcher thread entry
+                void run() {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    while (true) {
+                        if (threads > target_threads) {
+                            threads--;
+                            return;
+                        }
+
+                        // Move all expired timers to the ready queue
+                        const auto now = std::chrono::steady_clock::now();
+                        while (timers && timers->time <= now) {
+                            dispatch_target *t = timers;
+                            timers = t->next;
+                            t->next = nullptr;
+                            t->timed = false;
+                            make_ready(t);
+                        }
+
+                        if (ready) {
+                            dispatch_target *t = ready;
+                            ready = t->next;
+                            if (!ready) ready_tail = nullptr;
+
+                            t->next = nullptr;
+                            t->queued = false;
+                            t->running = true;
+
+                            lock.unlock();
+                            const bool keep = t->dispatch();
+                            lock.lock();
+
+                            // Drop the reference once the target is not scheduled anymore.
+                            // A finished target is never scheduled again, even if a
+                            // producer scheduled it while it was running.
+                            std::shared_ptr<dispatch_target> released;
+                            t->running = false;
+                            if (!keep) {
+                                t->finished = true;
+                                t->rerun = false;
+                                if (t->timed) remove_timer(t);
+                                released = std::move(t->hold);
+                            } else if (t->rerun) {
+                                t->rerun = false;
+                                make_ready(t);
+                            } else if (!t->timed) {
+                                released = std::move(t->hold);
+                            }
+
+                            // The target may be deleted with the last reference
+                            lock.unlock();
+                            released.reset();
+                            lock.lock();
+                        } else if (timers) {
+                            cv.wait_until(lock, timers->time);
+                        } else {
+                            cv.wait(lock);
+                        }
+                    }
+                }
+
+                std::mutex mtx;
+                std::condition_variable cv;
+                // The targets ready to be dispatched
+                dispatch_target *ready = nullptr;
+                dispatch_target *ready_tail = nullptr;
+                // The targets to be dispatched at a later point in time, sorted by time
+                dispatch_target *timers = nullptr;
+                // The number of running threads
+                size_t threads = 0;
+                // The number of threads to run
+                size_t target_threads = 1;
+            };
+
+            /**
+             * A lock-free log-linear histogram backing histogram_snapshot
+             */
+            class histogram {
+            public:
+                /**
+                 * Record a value
+                 *
+                 * @param value the value to record
+                 */
+                inline void record(uint64_t value) noexcept {
+                    buckets[histogram_snapshot::bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+                    count.fetch_add(1, std::memory_order_relaxed);
+                    sum.fetch_add(value, std::memory_order_relaxed);
+
+                    uint64_t m = max.load(std::memory_order_relaxed);
+                    while (value > m && !max.compare_exchange_weak(m, value, std::memory_order_relaxed));
+                }
+
+                /**
+                 * Record a duration in nanoseconds
+                 *
+                 * @param duration the duration to record
+                 */
+                template<class Rep, class Period>
+                inline void record(std::chrono::duration<Rep, Period> duration) noexcept {
+                    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+                    record(static_cast<uint64_t>(std::max<decltype(ns)>(ns, 0)));
+                }
+
+                /**
+                 * Get a snapshot of the histogram
+                 *
+                 * @return the snapshot
+                 */
+                [[nodiscard]] inline histogram_snapshot snapshot() const {
+                    histogram_snapshot res;
+                    res.count = count.load(std::memory_order_relaxed);
+                    res.sum = sum.load(std::memory_order_relaxed);
+                    res.max = max.load(std::memory_order_relaxed);
+                    res.buckets.reserve(buckets.size());
+                    for (const auto &b: buckets) {
+                        res.buckets.push_back(b.load(std::memory_order_relaxed));
+                    }
+
+                    return res;
+                }
+
+            private:
+                std::array<std::atomic<uint64_t>, histogram_snapshot::bucket_count> buckets{};
+                std::atomic<uint64_t> count{0};
+                std::atomic<uint64_t> sum{0};
+                std::atomic<uint64_t> max{0};
+            };
+
+            /**
+             * Lock-free counters backing callback_stats
+             */
+            class stats_counter {
+            public:
+                /**
+                 * Record a delivered batch
+                 *
+                 * @param size the number of calls in the batch
+                 */
+                inline void record_batch(uint64_t size) {
+                    calls.fetch_add(size, std::memory_order_relaxed);
+                    batches.fetch_add(1, std::memory_order_relaxed);
+
+                    uint64_t max = max_batch_size.load(std::memory_order_relaxed);
+                    while (size > max && !max_batch_size.compare_exchange_weak(max, size, std::memory_order_relaxed));
+                }
+
+                /**
+                 * Record a call discarded because the queue was full
+                 */
+                inline void record_dropped() {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                /**
+                 * Record a call blocked because the queue was full
+                 */
+                inline void record_blocked() {
+                    blocked.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                /**
+                 * Record a call failed because the queue was full
+                 */
+                inline void record_failed() {
+                    failed.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                /**
+                 * Record a queued call replaced by a newer call
+                 */
+                inline void record_coalesced() {
+                    coalesced.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                /**
+                 * Record calls which could not be handed to the ThreadSafeFunction
+                 *
+                 * @param count the number of rejected calls
+                 */
+                inline void record_rejected(uint64_t count) {
+                    rejected.fetch_add(count, std::memory_order_relaxed);
+                }
+
+                /**
+                 * Record a call made directly on the js thread
+                 */
+                inline void record_direct() {
+                    direct.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                /**
+                 * Record a call skipped because it was cancelled
+                 */
+                inline void record_cancelled() {
+                    cancelled.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                /**
+                 * Record a call skipped because its deadline passed
+                 */
+                inline void record_timed_out() {
+                    timed_out.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                /**
+                 * Record a call which failed on the js thread
+                 */
+                inline void record_error() {
+                    errors.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                /**
+                 * Record the number of queued calls
+                 *
+                 * @param depth the number of calls in the queue
+                 */
+                inline void record_queue_depth(uint64_t depth) {
+                    uint64_t max = queue_high_water.load(std::memory_order_relaxed);
+                    while (depth > max && !queue_high_water.compare_exchange_weak(max, depth, std::memory_order_relaxed));
+                }
+
+                // The time between queueing a call and starting it on the js thread
+                histogram queue_latency;
+                // The time spent running the javascript function
+                histogram js_time;
+                // The time spent converting the arguments and the result
+                histogram conversion_time;
+
+                /**
+                 * Get a snapshot of the counters
+                 *
+                 * @return the statistics
+                 */
+                [[nodiscard]] inline callback_stats snapshot() const {
+                    callback_stats res;
+                    res.calls = calls.load(std::memory_order_relaxed);
+                    res.batches = batches.load(std::memory_order_relaxed);
+                    res.max_batch_size = max_batch_size.load(std::memory_order_relaxed);
+                    res.dropped = dropped.load(std::memory_order_relaxed);
+                    res.blocked = blocked.load(std::memory_order_relaxed);
+                    res.failed = failed.load(std::memory_order_relaxed);
+                    res.coalesced = coalesced.load(std::memory_order_relaxed);
+                    res.rejected = rejected.load(std::memory_order_relaxed);
+                    res.direct = direct.load(std::memory_order_relaxed);
+                    res.cancelled = cancelled.load(std::memory_order_relaxed);
+                    res.timed_out = timed_out.load(std::memory_order_relaxed);
+                    res.errors = errors.load(std::memory_order_relaxed);
+                    res.queue_high_water = queue_high_water.load(std::memory_order_relaxed);
+                    res.queue_latency = queue_latency.snapshot();
+                    res.js_time = js_time.snapshot();
+                    res.conversion_time = conversion_time.snapshot();
+
+                    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - created;
+                    if (elapsed.count() > 0) {
+                        res.calls_per_second = (double) res.calls / elapsed.count();
+                    }
+
+                    return res;
+                }
+
+            private:
+                std::atomic<uint64_t> calls{0};
+                std::atomic<uint64_t> batches{0};
+                std::atomic<uint64_t> max_batch_size{0};
+                std::atomic<uint64_t> dropped{0};
+                std::atomic<uint64_t> blocked{0};
+                std::atomic<uint64_t> failed{0};
+                std::atomic<uint64_t> coalesced{0};
+                std::atomic<uint64_t> rejected{0};
+                std::atomic<uint64_t> direct{0};
+                std::atomic<uint64_t> cancelled{0};
+                std::atomic<uint64_t> timed_out{0};
+                std::atomic<uint64_t> errors{0};
+                std::atomic<uint64_t> queue_high_water{0};
+                const std::chrono::steady_clock::time_point created = std::chrono::steady_clock::now();
+            };
+
+#ifdef NAPI_TOOLS_COROUTINES
+            template<class T, class R, class...Args>
+            class awaitable;
+#endif //NAPI_TOOLS_COROUTINES
+
+            /**
+             * The callback template
+             *
+             * @tparam T the javascriptCallback class type
+             */
+            template<class T, class...Args>
+            class callback_template {
+            public:
+                /**
+                 * Construct an empty callback function.
+                 * Will throw an exception when trying to call.
+                 */
+                callback_template() noexcept: ptr(nullptr) {}
+
+                /**
+                 * Construct an empty callback function.
+                 * Will throw an exception when trying to call.
+                 */
+                callback_template(std::nullptr_t) noexcept: ptr(nullptr) {}
+
+                /**
+                 * Construct a callback function
+                 *
+                 * @param info the CallbackInfo with typeof info[0] == 'function'
+                 * @param converter an optional function to do the type conversions
+                 * @param opts the dispatch options
+                 */
+                explicit callback_template(const Napi::CallbackInfo &info,
+                                           const converter<Args...> &converter = nullptr,
+                                           const options &opts = {})
+                        : ptr(std::make_shared<wrapper>(info, converter, opts)), converter(converter), opts(opts) {}
+
+                /**
                  * Construct a callback function
                  *
-                 * @param info the CallbackInfo with typeof info[0] == 'function'
-                 * @param converter an optional function to do the type conversions
+                 * @param env the environment to work in
+                 * @param func the function to call
+                 * @param converter an optional function to do the type conversions
+                 * @param opts the dispatch options
+                 */
+                callback_template(const Napi::Env &env, const Napi::Function &func,
+                                  const converter<Args...> &converter = nullptr, const options &opts = {})
+                        : ptr(std::make_shared<wrapper>(env, func, converter, opts)), converter(converter),
+                          opts(opts) {}
+
+                /**
+                 * Copy a callback function. Both share the same javascript function.
+                 *
+                 * @param other the callback to copy
+                 */
+                callback_template(const callback_template &other) : ptr(other.ptr) {
+                    std::unique_lock<std::mutex> lock(other.settings_mtx);
+                    this->copySettings(other);
+                }
+
+                /**
+                 * Copy a callback function. Both share the same javascript function.
+                 *
+                 * @param other the callback to copy
+                 * @return this callback
+                 */
+                callback_template &operator=(const callback_template &other) {
+                    if (this != &other) {
+                        std::scoped_lock lock(settings_mtx, other.settings_mtx);
+                        this->ptr = other.ptr;
+                        this->copySettings(other);
+                    }
+
+                    return *this;
+                }
+
+                /**
+                 * Get the underlying promise
+                 *
+                 * @return the promise
+                 */
+                [[nodiscard]] inline Napi::Promise getPromise() const {
+                    const auto p = ptr.load();
+                    if (p && !p->stopped) {
+                        return p->fn->getPromise();
+                    } else {
+                        throw std::runtime_error("Callback was never initialized");
+                    }
+                }
+
+                /**
+                 * Get the underlying promise
+                 *
+                 * @return the promise
+                 */
+                [[nodiscard]] inline operator Napi::Promise() const {
+                    return this->getPromise();
+                }
+
+                /**
+                 * Get the underlying promise
+                 *
+                 * @return the promise
+                 */
+                [[nodiscard]] inline operator Napi::Value() const {
+                    return this->operator Napi::Promise();
+                }
+
+                /**
+                 * Get the setter function for this callback
+                 *
+                 * @param env the environment to run in
+                 * @param setOnlyOnce whether to allow this callback to only get set once.
+                 *                      Will throw an exception when tried to set a second time.
+                 * @return the setter function
+                 */
+                inline Napi::Function getSetter(const Napi::Env &env, bool setOnlyOnce = false) {
+                    return Napi::Function::New(env, [this, setOnlyOnce](const Napi::CallbackInfo &info) {
+                        if (setOnlyOnce && this->operator bool()) {
+                            throw Napi::Error::New(info.Env(),
+                                                   "Tried to set a callback twice, which was not allowed to be set twice");
+                        }
+                        TRY
+                            // Calls made before the swap drain on the previous instance.
+                            // Settings changed meanwhile apply to the new instance.
+                            std::unique_lock<std::mutex> lock(settings_mtx);
+                            auto p = std::make_shared<wrapper>(info, converter, opts);
+                            if (key) {
+                                p->fn->setCoalescingKey(key);
+                            }
+
+                            Napi::Promise promise = p->fn->getPromise();
+                            this->ptr.store(std::move(p));
+                            return promise;
+                        CATCH_EXCEPTIONS
+                    });
+                }
+
+                /**
+                 * Export the setter in the init function. Or wherever you like.
+                 *
+                 * @param env the environment to run in
+                 * @param exports the exports object. Will set the setter function at index name.
+                 * @param name the name of the setter function
+                 * @param setOnlyOnce whether to allow this callback to only get set once.
+                 *                      Will throw an exception when tried to set a second time.
+                 */
+                inline void exportSetter(const Napi::Env &env, Napi::Object &exports, const std::string &name,
+                                         bool setOnlyOnce = false) {
+                    exports.Set(name, this->getSetter(env, setOnlyOnce));
+                }
+
+                /**
+                 * Get a function returning the statistics of this callback
+                 *
+                 * @param env the environment to run in
+                 * @return the function returning the statistics
+                 */
+                inline Napi::Function getStatsFunction(const Napi::Env &env) {
+                    return Napi::Function::New(env, [this](const Napi::CallbackInfo &info) {
+                        return callback_stats::toNapiValue(info.Env(), this->getStats());
+                    });
+                }
+
+                /**
+                 * Export a function returning the statistics of this callback.
+                 * Exported next to the setter in the init function.
+                 *
+                 * @param env the environment to run in
+                 * @param exports the exports object. Will set the function at index name.
+                 * @param name the name of the function
+                 */
+                inline void exportStats(const Napi::Env &env, Napi::Object &exports, const std::string &name) {
+                    exports.Set(name, this->getStatsFunction(env));
+                }
+
+                /**
+                 * Set the dispatch options. Used by callbacks created
+                 * by the setter function returned by getSetter().
+                 *
+                 * @param newOptions the new options
+                 */
+                inline void setOptions(const options &newOptions) {
+                    std::unique_lock<std::mutex> lock(settings_mtx);
+                    this->opts = newOptions;
+                }
+
+                /**
+                 * Set the function returning the key of a call. If coalescing is
+                 * enabled, a new call only replaces queued calls with the same key.
+                 * Applies to the current and all callbacks created by the setter function.
+                 *
+                 * @param key the key function
+                 */
+                inline void setCoalescingKey(const key_func<Args...> &key) {
+                    std::unique_lock<std::mutex> lock(settings_mtx);
+                    this->key = key;
+                    if (const auto p = ptr.load()) {
+                        p->fn->setCoalescingKey(key);
+                    }
+                }
+
+#ifdef NAPI_TOOLS_COROUTINES
+                /**
+                 * Set the executor resuming coroutines awaiting a call.
+                 * Coroutines are resumed on the javascript thread by default.
+                 *
+                 * @param newExecutor the new executor
+                 */
+                inline void setExecutor(const executor &newExecutor) {
+                    std::unique_lock<std::mutex> lock(settings_mtx);
+                    this->exec = newExecutor;
+                }
+#endif //NAPI_TOOLS_COROUTINES
+
+                /**
+                 * Get the statistics of the callback.
+                 * Returns empty statistics if the callback is not initialized.
+                 *
+                 * @return the current statistics
+                 */
+                [[nodiscard]] inline callback_stats getStats() const {
+                    if (const auto p = ptr.load()) {
+                        return p->fn->getStats();
+                    } else {
+                        return callback_stats();
+                    }
+                }
+
+                /**
+                 * Get the number of queued calls and calls not yet run on the js thread
+                 *
+                 * @return the number of pending calls, 0 if not initialized
+                 */
+                [[nodiscard]] inline size_t getBacklog() const {
+                    const auto p = ptr.load();
+                    return p ? p->fn->getBacklog() : 0;
+                }
+
+                /**
+                 * Check if the promise is initialized and not stopped
+                 *
+                 * @return true, if initialized and running
+                 */
+                [[nodiscard]] inline operator bool() const {
+                    const auto p = ptr.load();
+                    return p && !p->stopped;
+                }
+
+                /**
+                 * Check if the promise is not initialized or stopped
+                 *
+                 * @return true, if not initialized or is stopped
+                 */
+                [[nodiscard]] inline bool stopped() const {
+                    const auto p = ptr.load();
+                    return !p || p->stopped;
+                }
+
+                /**
+                 * Stop the callback function and deallocate all resources
+                 */
+                inline void stop() {
+                    const auto p = ptr.load();
+                    if (p && !p->stopped.exchange(true)) {
+                        p->fn->stop();
+                    }
+                }
+
+                /**
+                 * Stop the callback function and deallocate all resources
+                 *
+                 * @param policy what to do with the queued calls
+                 */
+                inline void stop(shutdown_policy policy) {
+                    const auto p = ptr.load();
+                    if (p && !p->stopped.exchange(true)) {
+                        p->fn->stop(policy);
+                    }
+                }
+
+                /**
+                 * Default destructor
+                 */
+                inline ~callback_template() = default;
+
+            protected:
+#ifdef NAPI_TOOLS_COROUTINES
+                template<class, class, class...>
+                friend class awaitable;
+#endif //NAPI_TOOLS_COROUTINES
+
+                /**
+                 * Queue a call
+                 *
+                 * @param ctx the call context
+                 * @param args the function arguments
+                 * @param complete the function to pass the result or the error to
+                 */
+                inline void enqueue(const call_context &ctx, Args...args, typename T::completion complete) {
+                    const auto p = ptr.load();
+                    if (p && !p->stopped) {
+                        p->fn->asyncCall(ctx, std::forward<Args>(args)..., std::move(complete));
+                    } else {
+                        throw std::runtime_error("Callback was never initialized");
+                    }
+                }
+
+                /**
+                 * Call the function directly. Must be called on the javascript thread.
+                 *
+                 * @param args the function arguments
+                 * @param complete the function to pass the result or the error to
+                 */
+                // Copy the settings of another callback. Both settings mutexes must be locked.
+                inline void copySettings(const callback_template &other) {
+                    converter = other.converter;
+                    opts = other.opts;
+                    key = other.key;
+#ifdef NAPI_TOOLS_COROUTINES
+                    exec = other.exec;
+#endif //NAPI_TOOLS_COROUTINES
+                }
+
+#ifdef NAPI_TOOLS_COROUTINES
+                /**
+                 * Get the executor resuming coroutines awaiting a call
+                 *
+                 * @return a copy of the executor
+                 */
+                [[nodiscard]] inline executor getExecutor() const {
+                    std::unique_lock<std::mutex> lock(settings_mtx);
+                    return exec;
+                }
+#endif //NAPI_TOOLS_COROUTINES
+
+                inline void invokeDirect(Args...args, typename T::completion complete) {
+                    const auto p = ptr.load();
+                    if (p && !p->stopped) {
+                        p->fn->directCall(call_context(), std::forward<Args>(args)..., std::move(complete), false);
+                    } else {
+                        throw std::runtime_error("Callback was never initialized");
+                    }
+                }
+
+                /**
+                 * A class for wrapping around the javascriptCallback class
+                 */
+                class wrapper {
+                public:
+                    /**
+                     * Create a wrapper instance
+                     *
+                     * @param info the callbackInfo to construct the callback
+                     * @param converter an optional function to do the type conversions
+                     * @param opts the dispatch options
+                     */
+                    wrapper(const Napi::CallbackInfo &info, const converter<Args...> &converter,
+                            const options &opts) : fn(T::create(info, converter, opts)), stopped(false) {}
+
+                    /**
+                     * Create a wrapper instance
+                     *
+                     * @param env the environment to work in
+                     * @param func the function to wrap the callback around
+                     * @param converter an optional function to do the type conversions
+                     * @param opts the dispatch options
+                     */
+                    wrapper(const Napi::Env &env, const Napi::Function &func, const converter<Args...> &converter,
+                            const options &opts) : fn(T::create(env, func, converter, opts)), stopped(false) {}
+
+                    /**
+                     * Stop the callback. Queued calls are still delivered.
+                     */
+                    ~wrapper() {
+                        if (!stopped) fn->stop();
+                    }
+
+                    std::shared_ptr<T> fn;
+                    std::atomic<bool> stopped;
+                };
+
+                /**
+                 * The ptr holding the wrapper. Swapped atomically,
+                 * callers keep the instance they loaded alive.
+                 */
+                ::napi_tools::util::atomic_shared_ptr<wrapper> ptr;
+                // Guards the settings below, which may be changed on any thread
+                mutable std::mutex settings_mtx;
+                util::converter<Args...> converter;
+                options opts;
+                key_func<Args...> key;
+#ifdef NAPI_TOOLS_COROUTINES
+                executor exec;
+#endif //NAPI_TOOLS_COROUTINES
+            };
+
+#ifdef NAPI_TOOLS_COROUTINES
+            /**
+             * An awaitable javascript call. The call is queued when the awaitable
+             * is awaited, the awaiting coroutine is resumed using the executor
+             * once the javascript function returned. Calls which are discarded
+             * because the queue is full or coalesced resume with an exception.
+             *
+             * @tparam T the javascriptCallback class type
+             * @tparam R the return type
+             * @tparam Args the argument types
+             */
+            template<class T, class R, class...Args>
+            class awaitable {
+            public:
+                /**
+                 * Create an awaitable call
+                 *
+                 * @param cb the callback to call
+                 * @param exec the executor to resume the coroutine on
+                 * @param ctx the call context
+                 * @param args the function arguments
+                 */
+                awaitable(callback_template<T, Args...> *cb, executor exec, call_context ctx, Args...args)
+                        : cb(cb), exec(std::move(exec)), ctx(std::move(ctx)), args_t(std::forward<Args>(args)...) {}
+
+                awaitable(const awaitable &) = delete;
+
+                awaitable &operator=(const awaitable &) = delete;
+
+                /**
+                 * The call is never complete before being awaited
+                 *
+                 * @return false
+                 */
+                [[nodiscard]] inline bool await_ready() const noexcept {
+                    return false;
+                }
+
+                /**
+                 * Queue the call
+                 *
+                 * @param h the handle of the awaiting coroutine
+                 * @return false, if the call already completed and the coroutine should not be suspended
+                 */
+                inline bool await_suspend(std::coroutine_handle<> h) {
+                    handle = h;
+                    std::apply([this](auto &&... el) {
+                        cb->enqueue(ctx, std::forward<decltype(el)>(el)..., resumer(this));
+                    }, std::move(args_t));
+
+                    // Whoever is second of this and the completion resumes the coroutine
+                    return !ready.exchange(true, std::memory_order_acq_rel);
+                }
+
+                /**
+                 * Get the result of the call
+                 *
+                 * @return the value returned by the javascript function
+                 */
+                inline R await_resume() {
+                    if (error) {
+                        throw *error;
+                    }
+
+                    if constexpr (!std::is_void_v<R>) {
+                        return std::move(*result);
+                    }
+                }
+
+            private:
+                using result_type = std::conditional_t<std::is_void_v<R>, char, R>;
+
+                /**
+                 * The completion function of the call.
+                 * Completes the call with an error if destroyed without being called.
+                 */
+                class resumer {
+                public:
+                    explicit resumer(awaitable *self) noexcept: self(self) {}
+
+                    resumer(resumer &&other) noexcept: self(std::exchange(other.self, nullptr)) {}
+
+                    resumer &operator=(resumer &&) = delete;
+
+                    template<class U = R, std::enable_if_t<!std::is_void_v<U>, int> = 0>
+                    inline void operator()(U *val, const ::napi_tools::exception *ex) {
+                        std::exchange(self, nullptr)->complete(val, ex);
+                    }
+
+                    template<class U = R, std::enable_if_t<std::is_void_v<U>, int> = 0>
+                    inline void operator()(const ::napi_tools::exception *ex) {
+                        std::exchange(self, nullptr)->complete(nullptr, ex);
+                    }
+
+                    ~resumer() {
+                        if (self) {
+                            const ::napi_tools::exception ex("The call was discarded");
+                            self->complete(nullptr, &ex);
+                        }
+                    }
+
+                private:
+                    awaitable *self;
+                };
+
+                /**
+                 * Store the result and resume the coroutine, if it is suspended
+                 *
+                 * @param val the result, nullptr if void or failed
+                 * @param ex the error, nullptr if successful
+                 */
+                inline void complete(result_type *val, const ::napi_tools::exception *ex) {
+                    if (ex) {
+                        error.emplace(*ex);
+                    } else if constexpr (!std::is_void_v<R>) {
+                        result.emplace(std::move(*val));
+                    }
+
+                    if (ready.exchange(true, std::memory_order_acq_rel)) {
+                        if (exec) {
+                            exec(handle);
+                        } else {
+                            handle.resume();
+                        }
+                    }
+                }
+
+                callback_template<T, Args...> *cb;
+                executor exec;
+                call_context ctx;
+                std::tuple<Args...> args_t;
+                std::coroutine_handle<> handle;
+                std::atomic<bool> ready{false};
+                std::optional<result_type> result;
+                std::optional<::napi_tools::exception> error;
+            };
+#endif //NAPI_TOOLS_COROUTINES
+        } // namespace util
+
+        /**
+         * Set the number of threads dispatching the calls of all
+         * javascript callbacks to the js thread. Defaults to one.
+         *
+         * @param count the number of dispatcher threads
+         */
+        inline void setDispatcherThreads(size_t count) {
+            util::dispatcher::instance().setThreadCount(count);
+        }
+
+        /**
+         * A javascript callback
+         */
+        template<class>
+        class javascriptCallback;
+
+        /**
+         * A javascript callback. R may be void.
+         *
+         * @tparam R the return type
+         * @tparam A the argument types
+         */
+        template<class R, class...A>
+        class javascriptCallback<R(A...)> : private util::dispatch_target {
+        public:
+            using completion = util::completion_t<R>;
+
+            /**
+             * Create a javascript callback
+             *
+             * @param info the callback info. info[0] must be a napi function
+             * @param converter an optional function to do the type conversions
+             * @param opts the dispatch options
+             */
+            explicit inline javascriptCallback(const Napi::CallbackInfo &info,
+                                               const util::converter<A...> &converter,
+                                               const options &opts = {})
+                    : mtx(), deferred(Napi::Promise::Deferred::New(info.Env())), js_thread(std::this_thread::get_id()),
+                      converter(converter), opts(opts) {
+                CHECK_ARGS(::napi_tools::napi_type::function);
+                Napi::Env env = info.Env();
+
+                run = true;
+                function = Napi::Persistent(info[0].As<Napi::Function>());
+                if (this->opts.max_batch_size == 0) this->opts.max_batch_size = 1;
+
+                createThreadSafeFunction(env, info[0].As<Napi::Function>());
+
+                // Stop the callback if the environment shuts down
+                napi_add_env_cleanup_hook(env, CleanupHook, this);
+            }
+
+            /**
+             * Create a javascript callback
+             *
+             * @param env the environment to work in
+             * @param func the function to wrap the callback around
+             * @param converter an optional function to do the type conversions
+             * @param opts the dispatch options
+             */
+            javascriptCallback(const Napi::Env &env, const Napi::Function &func,
+                               const util::converter<A...> &converter, const options &opts = {})
+                    : run(true), mtx(), deferred(Napi::Promise::Deferred::New(env)),
+                      function(Napi::Persistent(func)), js_thread(std::this_thread::get_id()), converter(converter),
+                      opts(opts) {
+                if (this->opts.max_batch_size == 0) this->opts.max_batch_size = 1;
+
+                createThreadSafeFunction(env, func);
+
+                // Stop the callback if the environment shuts down
+                napi_add_env_cleanup_hook(env, CleanupHook, this);
+            }
+
+            /**
+             * Create a javascript callback. The instance is owned by the
+             * returned pointer and the ThreadSafeFunction, it is deleted
+             * once both released it.
+             *
+             * @param ctorArgs the constructor arguments
+             * @return the created instance
+             */
+            template<class...Ts>
+            static std::shared_ptr<javascriptCallback> create(Ts &&...ctorArgs) {
+                auto res = std::make_shared<javascriptCallback>(std::forward<Ts>(ctorArgs)...);
+                res->self = res;
+                res->weak_target = std::shared_ptr<util::dispatch_target>(res, static_cast<util::dispatch_target *>(res.get()));
+                return res;
+            }
+
+            /**
+             * The destructor. All batches are back in the
+             * pool as the function has been finalized.
+             */
+            ~javascriptCallback() noexcept {
+                for (batch *b: pool) {
+                    delete b;
+                }
+            }
+
+            /**
+             * Async call the javascript function
+             *
+             * @param ctx the call context
+             * @param values the values to pass to the function
+             * @param complete the function to pass the result or the error to
+             */
+            inline void asyncCall(const call_context &ctx, A &&...values, completion complete) {
+                NAPI_TOOLS_TRACE_SPAN("callback", "enqueue");
+                if (ctx.cancelled()) {
+                    stats.record_cancelled();
+                    util::complete_with_error<R>(complete, exception("The call was cancelled"));
+                    return;
+                } else if (ctx.expired()) {
+                    stats.record_timed_out();
+                    util::complete_with_error<R>(complete, exception("The call timed out"));
+                    return;
+                }
+
+                // Skip the queue if called on the js thread. The caller may wait for
+                // the result synchronously, so a returned promise is not adopted.
+                if (opts.direct_calls && onJsThread()) {
+                    directCall(ctx, std::forward<A>(values)..., std::move(complete), false);
+                    return;
+                }
+
+                // Dropped calls are failed after unlocking
+                std::optional<args> dropped;
+                std::unique_lock<std::mutex> lock(mtx);
+                if (!run) {
+                    throw std::runtime_error("The callback has been stopped");
+                }
+
+                // Replace a queued call with the same key, if coalescing is enabled.
+                // There is at most one queued call per key, the queue is never longer than the number of keys.
+                size_t call_key = 0;
+                if (opts.coalesce) {
+                    if (key) call_key = key(values...);
+
+                    const auto slot = slots.find(call_key);
+                    if (slot != slots.end()) {
+                        const auto it = queue.begin() + slot->second;
+                        // Fail the replaced call after unlocking, its completion may resume a coroutine
+                        args replaced = std::move(*it);
+                        *it = args(ctx, std::forward<A>(values)..., std::move(complete));
+                        it->key = call_key;
+                        stats.record_coalesced();
+                        lock.unlock();
+                        replaced.reject(exception("The call was dropped"));
+                        return;
+                    }
+                }
+
+                if (opts.capacity > 0 && outstanding >= opts.capacity) {
+                    switch (opts.policy) {
+                        case overflow_policy::block:
+                            stats.record_blocked();
+                            space_cv.wait(lock, [this] {
+                                return !run || outstanding < opts.capacity;
+                            });
+
+                            if (!run) {
+                                throw std::runtime_error("The callback has been stopped");
+                            }
+                            break;
+                        case overflow_policy::drop_oldest:
+                            stats.record_dropped();
+                            // Calls which are already dispatched cannot be dropped,
+                            // drop the new call if there are no queued calls
+                            if (queue.size() == queue_head) {
+                                lock.unlock();
+                                util::complete_with_error<R>(complete, exception("The call was dropped"));
+                                return;
+                            }
+
+                            // Dropped calls are only skipped and removed at once when they make up
+                            // half of the queue, so dropping is O(1) amortized. A std::deque would
+                            // free its blocks on every swap and allocate while queueing again.
+                            dropped.emplace(std::move(queue[queue_head++]));
+                            if (opts.coalesce) slots.erase(dropped->key);
+                            if (queue_head * 2 >= queue.size()) {
+                                queue.erase(queue.begin(), queue.begin() + queue_head);
+                                for (auto &entry: slots) {
+                                    entry.second -= queue_head;
+                                }
+
+                                queue_head = 0;
+                            }
+
+                            outstanding--;
+                            backlog.fetch_sub(1, std::memory_order_relaxed);
+                            break;
+                        case overflow_policy::drop_newest:
+                            lock.unlock();
+                            stats.record_dropped();
+                            util::complete_with_error<R>(complete, exception("The call was dropped"));
+                            return;
+                        case overflow_policy::fail:
+                            lock.unlock();
+                            stats.record_failed();
+                            util::complete_with_error<R>(complete, exception("The callback queue is full"));
+                            return;
+                    }
+                }
+
+                queue.emplace_back(ctx, std::forward<A>(values)..., std::move(complete));
+                queue.back().key = call_key;
+                if (opts.coalesce) slots.emplace(call_key, queue.size() - 1);
+                const size_t size = queue.size() - queue_head;
+                if (opts.capacity > 0) outstanding++;
+                backlog.fetch_add(1, std::memory_order_relaxed);
+                lock.unlock();
+                stats.record_queue_depth(size);
+                if (dropped) {
+                    dropped->reject(exception("The call was dropped"));
+                }
+
+                // Schedule the callback for dispatching if the queue was empty
+                // or a batch just filled up. If batching is enabled, give the batch
+                // some time to fill up before dispatching it. A non-empty queue is
+                // always scheduled already, so other calls don't touch the dispatcher.
+                auto &d = util::dispatcher::instance();
+                if (size == opts.max_batch_size) {
+                    d.schedule(this);
+                } else if (size == 1) {
+                    if (opts.max_linger.count() > 0) {
+                        d.schedule_at(this, std::chrono::steady_clock::now() + opts.max_linger);
+                    } else {
+                        d.schedule(this);
+                    }
+                }
+            }
+
+            /**
+             * Call the javascript function synchronously.
+             * Must be called on the javascript thread.
+             *
+             * @param ctx the call context
+             * @param values the values to pass to the function
+             * @param complete the function to pass the result or the error to
+             * @param adopt whether to complete the call once a returned promise settled.
+             *              If false, complete is called before this returns and a
+             *              returned promise fails the call, unless R is void.
+             */
+            inline void directCall(const call_context &ctx, A &&...values, completion complete, bool adopt = true) {
+                if (!onJsThread()) {
+                    throw std::runtime_error("Direct calls must be made on the javascript thread");
+                }
+
+                if (!run) {
+                    throw std::runtime_error("The callback has been stopped");
+                }
+
+                const Napi::Env env = function.Env();
+                Napi::HandleScope scope(env);
+                args ar(ctx, std::forward<A>(values)..., std::move(complete));
+                if (!ar.skip(stats)) {
+                    ar.invoke(env, function.Value(), converter, stats, adopt);
+                    stats.record_direct();
+                }
+            }
+
+            /**
+             * Get the number of queued calls and calls not yet run on the js thread
+             *
+             * @return the number of pending calls
+             */
+            [[nodiscard]] inline size_t getBacklog() const noexcept {
+                return backlog.load(std::memory_order_relaxed);
+            }
+
+            /**
+             * Check if the current thread is the javascript thread
+             *
+             * @return true, if called on the javascript thread
+             */
+            [[nodiscard]] inline bool onJsThread() const noexcept {
+                return std::this_thread::get_id() == js_thread;
+            }
+
+            /**
+             * Get the promise
+             *
+             * @return the Napi::Promise
+             */
+            [[nodiscard]] inline Napi::Promise getPromise() const {
+                return deferred.Promise();
+            }
+
+            /**
+             * Get the statistics of this callback
+             *
+             * @return the current statistics
+             */
+            [[nodiscard]] inline callback_stats getStats() const {
+                return stats.snapshot();
+            }
+
+            /**
+             * Set the function returning the key of a call, used to coalesce calls
+             *
+             * @param key_fn the key function
+             */
+            inline void setCoalescingKey(const util::key_func<A...> &key_fn) {
+                std::unique_lock<std::mutex> lock(mtx);
+                key = key_fn;
+            }
+
+            /**
+             * Stop the function and deallocate all resources.
+             * Queued calls are handled according to the shutdown policy.
+             */
+            inline void stop() {
+                stop(opts.on_stop);
+            }
+
+            /**
+             * Stop the function and deallocate all resources.
+             * Returns immediately, the function is released by the dispatcher.
+             *
+             * @param policy what to do with the queued calls
+             */
+            inline void stop(shutdown_policy policy) {
+                std::unique_lock<std::mutex> lock(mtx);
+                if (!run) {
+                    // Allow discarding calls of a callback which is already draining
+                    if (policy == shutdown_policy::discard) stop_policy = policy;
+                    return;
+                }
+
+                run = false;
+                stop_policy = policy;
+                lock.unlock();
+
+                // Wake up all blocked callers
+                space_cv.notify_all();
+
+                // Schedule the callback, so the dispatcher releases it
+                util::dispatcher::instance().schedule(this);
+            }
+
+        private:
+            /**
+             * Completes a call once the promise returned by the javascript function settled
+             */
+            class adopted_call : public ::napi_tools::util::promise_adopter::handler {
+            public:
+                explicit adopted_call(completion complete) : complete(std::move(complete)) {}
+
+                void resolve(const Napi::Env &env, const Napi::Value &value) override {
+                    std::optional<result_type> ret;
+                    if constexpr (!std::is_void_v<R>) {
+                        try {
+                            ret.emplace(::napi_tools::util::conversions::convertToCpp<R>(env, value));
+                        } catch (const std::exception &e) {
+                            this->fail(exception(e.what()));
+                            return;
+                        } catch (...) {
+                            this->fail(exception("The promise value could not be converted"));
+                            return;
+                        }
+                    }
+
+                    try {
+                        if constexpr (std::is_void_v<R>) {
+                            complete(nullptr);
+                        } else {
+                            complete(&*ret, nullptr);
+                        }
+                    } catch (const std::exception &e) {
+                        std::cerr << __FILE__ << ":" << __LINE__ << " Exception thrown: " << e.what() << std::endl;
+                    } catch (...) {
+                        std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
+                    }
+                }
+
+                void reject(const Napi::Env &env, const Napi::Value &reason) override {
+                    try {
+                        if (reason.IsObject()) {
+                            this->fail(exception::from_napi_error(Napi::Error(env, reason)));
+                            return;
+                        }
+                    } catch (...) {}
+
+                    this->fail(exception(reason.IsEmpty() || reason.IsObject() ? "The promise was rejected"
+                                                                                : reason.ToString().Utf8Value()));
+                }
+
+            private:
+                using result_type = std::conditional_t<std::is_void_v<R>, char, R>;
+
+                /**
+                 * Pass an error to the completion function
+                 *
+                 * @param ex the error to pass
+                 */
+                void fail(const exception &ex) {
+                    try {
+                        util::complete_with_error<R>(complete, ex);
+                    } catch (const std::exception &e) {
+                        std::cerr << __FILE__ << ":" << __LINE__ << " Exception thrown: " << e.what() << std::endl;
+                    } catch (...) {
+                        std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
+                    }
+                }
+
+                completion complete;
+            };
+
+            /**
+             * A class for storing arguments
+             */
+            class args {
+            public:
+                /**
+                 * Create a new args instance
+                 *
+                 * @param ctx the call context
+                 * @param values the values to store
+                 * @param complete the function to pass the result or the error to
+                 */
+                inline explicit args(const call_context &ctx, A &&...values, completion complete)
+                        : complete(std::move(complete)), context(ctx), queued(std::chrono::steady_clock::now()),
+                          args_t(std::forward<A>(values)...) {}
+
+                /**
+                 * Pass an error to the completion function
+                 * if this call was cancelled or timed out
+                 *
+                 * @param stats the statistics to record the skipped call in
+                 * @return true, if the call should be skipped
+                 */
+                inline bool skip(util::stats_counter &stats) {
+                    if (context.cancelled()) {
+                        stats.record_cancelled();
+                        reject(exception("The call was cancelled"));
+                        return true;
+                    } else if (context.expired()) {
+                        stats.record_timed_out();
+                        reject(exception("The call timed out"));
+                        return true;
+                    }
+
+                    return false;
+                }
+
+                /**
+                 * Convert the args and call the javascript function with them.
+                 * Unless a converter returning a std::vector is supplied, the
+                 * args are converted into an array on the stack.
+                 * Source: https://stackoverflow.com/a/42495119
+                 *
+                 * @param env the environment to work in
+                 * @param jsCallback the function to call
+                 * @param converter an optional function to do the type conversions
+                 * @param converted set to the time the args were converted
+                 * @return the value returned by the function
+                 */
+                inline Napi::Value call(const Napi::Env &env, const Napi::Function &jsCallback,
+                                        const util::converter<A...> &converter,
+                                        std::chrono::steady_clock::time_point &converted) {
+                    if (converter.to_vector) {
+                        std::vector<napi_value> argv;
+                        {
+                            NAPI_TOOLS_TRACE_SPAN("callback", "to_vector");
+                            argv = std::apply([&env, &converter](auto &&... el) {
+                                return converter.to_vector(env, std::forward<decltype(el)>(el)...);
+                            }, std::forward<std::tuple<A...>>(args_t));
+                        }
+
+                        converted = std::chrono::steady_clock::now();
+                        NAPI_TOOLS_TRACE_SPAN("callback", "js call");
+                        return jsCallback.Call(argv);
+                    }
+
+                    std::array<napi_value, sizeof...(A)> argv{};
+                    {
+                        NAPI_TOOLS_TRACE_SPAN("callback", "convert args");
+                        if (converter.to_span) {
+                            std::apply([&env, &converter, &argv](auto &&... el) {
+                                converter.to_span(env, std::span<napi_value, sizeof...(A)>(argv),
+                                                  std::forward<decltype(el)>(el)...);
+                            }, std::forward<std::tuple<A...>>(args_t));
+                        } else {
+                            std::apply([&env, &argv](auto &&... el) {
+                                argv = std::array<napi_value, sizeof...(A)>{
+                                        ::napi_tools::util::conversions::cppValToValue(env,
+                                                                                       std::forward<decltype(el)>(el))...};
+                            }, std::forward<std::tuple<A...>>(args_t));
+                        }
+                    }
+
+                    converted = std::chrono::steady_clock::now();
+                    NAPI_TOOLS_TRACE_SPAN("callback", "js call");
+                    napi_value result;
+                    napi_status status = napi_call_function(env, env.Undefined(), jsCallback, argv.size(),
+                                                            argv.data(), &result);
+                    if (status != napi_ok) {
+                        throw Napi::Error::New(env);
+                    }
+
+                    return {env, result};
+                }
+
+                /**
+                 * Call the javascript function with these arguments
+                 * and pass the result to the callback function.
+                 * Must be called on the main thread.
+                 *
+                 * @param env the environment to work in
+                 * @param jsCallback the function to call
+                 * @param converter an optional function to do the type conversions
+                 * @param stats the statistics to record the timings in
+                 * @param adopt whether to complete the call once a returned promise settled
+                 */
+                inline void invoke(const Napi::Env &env, const Napi::Function &jsCallback,
+                                   const util::converter<A...> &converter, util::stats_counter &stats,
+                                   bool adopt = true) {
+                    using clock = std::chrono::steady_clock;
+                    const clock::time_point start = clock::now();
+                    stats.queue_latency.record(start - queued);
+
+                    try {
+                        clock::time_point converted = start;
+                        Napi::Value val = call(env, jsCallback, converter, converted);
+                        const clock::time_point returned = clock::now();
+                        stats.js_time.record(returned - converted);
+
+                        // Complete the call once a returned promise settled,
+                        // unless the promise itself is the requested result.
+                        // A synchronous caller can't wait for a promise on this thread.
+                        if constexpr (!util::is_promise_ptr_v<R> && !std::is_same_v<R, Napi::Value>) {
+                            if (val.IsPromise()) {
+                                if (adopt) {
+                                    stats.conversion_time.record(converted - start);
+                                    ::napi_tools::util::promise_adopter::adopt(env, val, std::make_unique<adopted_call>(
+                                            std::move(complete)));
+                                    return;
+                                } else if constexpr (!std::is_void_v<R>) {
+                                    throw std::runtime_error("A direct call can not wait for the returned promise");
+                                }
+                            }
+                        }
+
+                        if constexpr (std::is_void_v<R>) {
+                            stats.conversion_time.record(converted - start);
+                            NAPI_TOOLS_TRACE_SPAN("callback", "continuation");
+                            complete(nullptr);
+                        } else {
+                            R ret = [&env, &val] {
+                                NAPI_TOOLS_TRACE_SPAN("callback", "convertToCpp");
+                                return ::napi_tools::util::conversions::convertToCpp<R>(env, val);
+                            }();
+
+                            stats.conversion_time.record((converted - start) + (clock::now() - returned));
+                            NAPI_TOOLS_TRACE_SPAN("callback", "continuation");
+                            complete(&ret, nullptr);
+                        }
+                    } catch (const Napi::Error &e) {
+                        stats.record_error();
+                        try {
+                            auto ex = exception::from_napi_error(e);
+                            ex.add_to_stack("napi_tools::callbacks::javascriptCallback::args::invoke",
+                                            __FILE__, __LINE__);
+                            util::complete_with_error<R>(complete, ex);
+                        } catch (const std::exception &e) {
+                            std::cerr << __FILE__ << ":" << __LINE__ << " Exception thrown: " << e.what() << std::endl;
+                        } catch (...) {
+                            std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
+                        }
+                    } catch (const std::exception &e) {
+                        stats.record_error();
+                        try {
+                            util::complete_with_error<R>(complete, exception(e.what()));
+                        } catch (const std::exception &e) {
+                            std::cerr << __FILE__ << ":" << __LINE__ << " Exception thrown: " << e.what() << std::endl;
+                        } catch (...) {
+                            std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
+                        }
+                    } catch (...) {
+                        stats.record_error();
+                        try {
+                            util::complete_with_error<R>(complete, exception("An unknown error occurred"));
+                        } catch (...) {
+                            std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
+                        }
+                    }
+                }
+
+                /**
+                 * Pass an error to the completion function of this call
+                 *
+                 * @param ex the error to pass
+                 */
+                inline void reject(const exception &ex) {
+                    try {
+                        util::complete_with_error<R>(complete, ex);
+                    } catch (const std::exception &e) {
+                        std::cerr << __FILE__ << ":" << __LINE__ << " Exception thrown: " << e.what() << std::endl;
+                    } catch (...) {
+                        std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
+                    }
+                }
+
+                completion complete;
+                // The coalescing key of this call
+                size_t key = 0;
+                call_context context;
+                // The time the call was queued
+                std::chrono::steady_clock::time_point queued;
+            private:
+                std::tuple<A...> args_t;
+            };
+
+            /**
+             * A batch of calls delivered in a single ThreadSafeFunction call.
+             * Batches are recycled and passed to the ThreadSafeFunction as they are,
+             * so dispatching does not allocate once the pool and the call vectors
+             * have grown large enough and the completion functions are stored inline.
+             */
+            struct batch {
+                // Keeps the callback alive while the batch is in the ThreadSafeFunction queue,
+                // which may be drained after the finalizer released the callback.
+                // Only set while the batch is not in the pool.
+                std::shared_ptr<javascriptCallback> owner;
+                std::vector<args> calls;
+            };
+
+            /**
+             * Create the ThreadSafeFunction. A plain napi_threadsafe_function
+             * is used, as Napi::ThreadSafeFunction allocates a wrapper for
+             * every call made with a callback.
+             *
+             * @param env the environment to work in
+             * @param func the function to call
+             */
+            void createThreadSafeFunction(const Napi::Env &env, const Napi::Function &func) {
+                napi_status status = napi_create_threadsafe_function(env, func, nullptr,
+                                                                     Napi::String::New(env, "javascriptCallback"),
+                                                                     opts.thread_safe_queue_size, 1, this,
+                                                                     FinalizerCallback, this, callJs, &ts_fn);
+                if (status != napi_ok) {
+                    throw Napi::Error::New(env, "napi_create_threadsafe_function failed with status " +
+                                                std::to_string(status));
+                }
+            }
+
+            // The ThreadSafeFunction callback. Runs all calls of a batch
+            // in a single ThreadSafeFunction call and HandleScope.
+            // env is nullptr if the function is finalized with batches left in its queue.
+            static void callJs(napi_env env, napi_value jsCallback, void *, void *data) {
+                auto *b = static_cast<batch *>(data);
+                // Deleted after the batch was recycled, if this is the last reference
+                const std::shared_ptr<javascriptCallback> self = std::move(b->owner);
+                if (env == nullptr) {
+                    self->rejectBatch(b, napi_closing);
+                    return;
+                }
+
+                NAPI_TOOLS_TRACE_SPAN("callback", "batch");
+                const Napi::Env e(env);
+                const Napi::Function fn(env, jsCallback);
+                for (args &ar: b->calls) {
+                    if (!ar.skip(self->stats)) {
+                        ar.invoke(e, fn, self->converter, self->stats);
+                    }
+                }
+
+                self->completed(b->calls.size());
+                self->releaseBatch(b);
+            }
+
+            /**
+             * Pass an error to all calls of a batch which could not be
+             * handed to or run by the ThreadSafeFunction and recycle the batch.
+             *
+             * @param b the batch to reject
+             * @param status the status returned by the ThreadSafeFunction
+             */
+            void rejectBatch(batch *b, napi_status status) {
+                std::string message;
+                if (status == napi_queue_full) {
+                    message = "The ThreadSafeFunction queue is full";
+                } else if (status == napi_closing) {
+                    message = "The ThreadSafeFunction is closing";
+                } else {
+                    message = "Napi::ThreadSafeFunction call failed with status " + std::to_string(status);
+                }
+
+                for (args &ar: b->calls) {
+                    ar.reject(exception(message));
+                }
+
+                stats.record_rejected(b->calls.size());
+                completed(b->calls.size());
+
+                releaseBatch(b);
+            }
+
+            /**
+             * Mark calls as completed, making space for new calls
+             *
+             * @param count the number of completed calls
+             */
+            void completed(size_t count) {
+                backlog.fetch_sub(count, std::memory_order_relaxed);
+                if (opts.capacity == 0) return;
+
+                std::unique_lock<std::mutex> lock(mtx);
+                outstanding -= count;
+                lock.unlock();
+
+                space_cv.notify_all();
+            }
+
+            /**
+             * Get a batch from the pool or create a new one
+             *
+             * @return the batch
+             */
+            batch *acquireBatch() {
+                std::unique_lock<std::mutex> lock(pool_mtx);
+                if (pool.empty()) {
+                    lock.unlock();
+                    return new batch();
+                }
+
+                batch *b = pool.back();
+                pool.pop_back();
+                return b;
+            }
+
+            /**
+             * Return a batch to the pool. Destroys the calls of the batch.
+             *
+             * @param b the batch to return
+             */
+            void releaseBatch(batch *b) {
+                b->calls.clear();
+                b->owner.reset();
+                std::unique_lock<std::mutex> lock(pool_mtx);
+                pool.push_back(b);
+            }
+
+            /**
+             * Deliver the queued calls to the js thread.
+             * Called by the dispatcher.
+             *
+             * @return false, if the callback was stopped and released
+             */
+            bool dispatch() override {
+                NAPI_TOOLS_TRACE_SPAN("callback", "dispatch");
+                // Take the queued calls and unlock the mutex, so
+                // producers never wait for the js calls to finish.
+                // No calls are queued once the callback is stopped.
+                std::unique_lock<std::mutex> lock(mtx);
+                const bool stopping = !run;
+                const bool discard = stopping && stop_policy == shutdown_policy::discard;
+                pending.swap(queue);
+                const size_t head = std::exchange(queue_head, 0);
+                slots.clear();
+                lock.unlock();
+
+                // Remove the calls dropped from the front of the queue
+                pending.erase(pending.begin(), pending.begin() + head);
+
+                if (discard) {
+                    for (args &ar: pending) {
+                        ar.reject(exception("The callback has been stopped"));
+                    }
+
+                    completed(pending.size());
+                    pending.clear();
+                }
+
+                // Skip cancelled and expired calls before they are handed to the js thread
+                bool deadlines = false;
+                const auto removed = std::remove_if(pending.begin(), pending.end(), [this, &deadlines](args &ar) {
+                    deadlines |= ar.context.has_deadline();
+                    return ar.skip(stats);
+                });
+
+                const auto skipped = static_cast<size_t>(pending.end() - removed);
+                if (skipped > 0) {
+                    pending.erase(removed, pending.end());
+                    completed(skipped);
+                }
+
+                // Deliver the calls with the nearest deadlines first,
+                // calls without a deadline keep their order and go last
+                if (deadlines) {
+                    std::stable_sort(pending.begin(), pending.end(), [](const args &a, const args &b) {
+                        return a.context.deadline < b.context.deadline;
+                    });
+                }
+
+                const size_t max_batch_size = opts.max_batch_size;
+                for (size_t i = 0; i < pending.size(); i += max_batch_size) {
+                    const size_t size = std::min(max_batch_size, pending.size() - i);
+                    batch *b = acquireBatch();
+                    b->owner = std::shared_ptr<javascriptCallback>(weak_target.lock(), this);
+                    b->calls.insert(b->calls.end(), std::make_move_iterator(pending.begin() + i),
+                                    std::make_move_iterator(pending.begin() + i + size));
+
+                    // Call the callback. The function may have been
+                    // finalized already if the environment shuts down.
+                    napi_status status;
+                    std::unique_lock<std::mutex> ts_lock(ts_mtx);
+                    if (finalized) {
+                        status = napi_closing;
+                    } else {
+                        status = napi_call_threadsafe_function(ts_fn, b, opts.mode == dispatch_mode::non_blocking
+                                                                         ? napi_tsfn_nonblocking
+                                                                         : napi_tsfn_blocking);
+                    }
+                    ts_lock.unlock();
+
+                    if (status == napi_ok) {
+                        stats.record_batch(size);
+                    } else {
+                        rejectBatch(b, status);
+                    }
+                }
+
+                // Clear the dispatched calls, keeping the capacity for the next swap
+                pending.clear();
+
+                if (stopping) {
+                    // The remaining calls are delivered before the finalizer is called
+                    std::unique_lock<std::mutex> ts_lock(ts_mtx);
+                    if (!finalized) {
+                        napi_release_threadsafe_function(ts_fn, napi_tsfn_release);
+                    }
+
+                    return false;
+                }
+
+                return true;
+            }
+
+            // The finalizer callback
+            static void FinalizerCallback(napi_env env, void *data, void *) {
+                auto *jsCallback = static_cast<javascriptCallback *>(data);
+                // Blocked calls return once the function is closing, so this never waits for long
+                std::unique_lock<std::mutex> ts_lock(jsCallback->ts_mtx);
+                jsCallback->finalized = true;
+                ts_lock.unlock();
+
+                napi_remove_env_cleanup_hook(env, CleanupHook, jsCallback);
+
+                // Resolve the promise
+                jsCallback->deferred.Resolve(Napi::Env(env).Null());
+                jsCallback->function.Reset();
+
+                // Drop the reference held by the ThreadSafeFunction.
+                // Deletes the instance, unless a wrapper still holds it.
+                std::shared_ptr<javascriptCallback> owner = std::move(jsCallback->self);
+            }
+
+            // Called if the environment shuts down before the callback was stopped
+            static void CleanupHook(void *data) {
+                static_cast<javascriptCallback *>(data)->stop(shutdown_policy::discard);
+            }
+
+            // Whether the callback accepts calls. Only set while holding mtx.
+            std::atomic<bool> run;
+            std::mutex mtx;
+            // What to do with the queued calls once stopped, guarded by mtx
+            shutdown_policy stop_policy = shutdown_policy::drain;
+            std::vector<args> queue;
+            // The number of dropped calls at the front of queue, guarded by mtx.
+            // The calls queued are the calls from this index on.
+            size_t queue_head = 0;
+            // The index in queue of the queued call with a key, if coalescing is enabled. Guarded by mtx.
+            std::unordered_map<size_t, size_t> slots;
+            // The number of queued calls and calls not yet run on the js thread.
+            // Only counted if the capacity is limited.
+            size_t outstanding = 0;
+            // The number of queued calls and calls not yet run on the js thread, always counted
+            std::atomic<size_t> backlog{0};
+            // Signalled when calls completed or the callback was stopped
+            std::condition_variable space_cv;
+            // The calls currently being dispatched. Only used by dispatch().
+            std::vector<args> pending;
+            // The recycled batches
+            std::mutex pool_mtx;
+            std::vector<batch *> pool;
+            const Napi::Promise::Deferred deferred;
+            napi_threadsafe_function ts_fn = nullptr;
+            // Guards the use of ts_fn against the finalizer
+            std::mutex ts_mtx;
+            // Whether the ThreadSafeFunction has been finalized, guarded by ts_mtx
+            bool finalized = false;
+            // The function, used for direct calls on the js thread
+            Napi::FunctionReference function;
+            // The reference held by the ThreadSafeFunction, released by the finalizer
+            std::shared_ptr<javascriptCallback> self;
+            // The id of the js thread
+            const std::thread::id js_thread;
+            util::converter<A...> converter;
+            // The coalescing key function, guarded by mtx
+            util::key_func<A...> key;
+            options opts;
+            util::stats_counter stats;
+        };
+
+        /**
+         * A class for creating javascript callbacks
+         */
+        template<class>
+        class callback;
+
+        /**
+         * A void javascript callback
+         *
+         * @tparam Args the argument types
+         */
+        template<class...Args>
+        class callback<void(Args...)> : public util::callback_template<javascriptCallback<void(Args...)>, Args...> {
+        public:
+            using cb_template = util::callback_template<javascriptCallback<void(Args...)>, Args...>;
+            using cb_template::cb_template;
+
+            /**
+             * Call the javascript function. Async call.
+             * The callback functions may be move-only.
+             *
+             * @param args the function arguments
+             * @param callback the function to call when the javascript function returned
+             * @param on_error the function to call if the call failed
+             */
+            template<class F, class E, class = std::enable_if_t<
+                    std::is_invocable_v<std::decay_t<F> &> &&
+                    std::is_invocable_v<std::decay_t<E> &, const ::napi_tools::exception &>>>
+            inline void call(Args...args, F &&callback, E &&on_error) {
+                this->call(call_context(), std::forward<Args>(args)..., std::forward<F>(callback),
+                           std::forward<E>(on_error));
+            }
+
+            /**
+             * Call the javascript function. Async call.
+             * The call is skipped and on_error is called if the context is cancelled.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @param callback the function to call when the javascript function returned
+             * @param on_error the function to call if the call failed
+             */
+            template<class F, class E, class = std::enable_if_t<
+                    std::is_invocable_v<std::decay_t<F> &> &&
+                    std::is_invocable_v<std::decay_t<E> &, const ::napi_tools::exception &>>>
+            inline void call(const call_context &ctx, Args...args, F &&callback, E &&on_error) {
+                if (util::is_empty(callback) || util::is_empty(on_error)) {
+                    throw std::runtime_error("The callback functions are not initialized");
+                }
+
+                this->enqueue(ctx, std::forward<Args>(args)..., util::make_completion<void>(std::forward<F>(callback),
+                                                                                            std::forward<E>(on_error)));
+            }
+
+            /**
+             * Call the javascript function.
+             *
+             * @param args the function arguments
+             * @return a promise to be resolved
+             */
+            std::future<void> call(Args...args) {
+                return this->call(call_context(), std::forward<Args>(args)...);
+            }
+
+            /**
+             * Call the javascript function.
+             * The call is skipped and the future fails if the context is cancelled.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @return a promise to be resolved
+             */
+            std::future<void> call(const call_context &ctx, Args...args) {
+                std::promise<void> promise;
+                std::future<void> future = promise.get_future();
+                this->enqueue(ctx, std::forward<Args>(args)..., [promise = std::move(promise)]
+                        (const napi_tools::exception *ex) mutable {
+                    if (ex) {
+                        promise.set_exception(std::make_exception_ptr(*ex));
+                    } else {
+                        promise.set_value();
+                    }
+                });
+
+                return future;
+            }
+
+            /**
+             * Call the javascript function with a supplied promise.
+             *
+             * @param args the function arguments
+             * @param promise the promise to be resolved
+             */
+            void call(Args...args, std::promise<void> &promise) {
+                this->enqueue(call_context(), std::forward<Args>(args)..., [&promise](const napi_tools::exception *ex) {
+                    if (ex) {
+                        promise.set_exception(std::make_exception_ptr(*ex));
+                    } else {
+                        promise.set_value();
+                    }
+                });
+            }
+
+            /**
+             * Call the javascript function and wait for it to finish
+             *
+             * @param args the function arguments
+             * @return the function return value
+             */
+            void callSync(Args...args) {
+                std::promise<void> promise;
+                std::future<void> future = promise.get_future();
+                this->call(std::forward<Args>(args)..., promise);
+
+                return future.get();
+            }
+
+            /**
+             * Call the javascript function and wait for it to finish.
+             * Throws if the context is cancelled before the function
+             * is called or the function did not return before the deadline.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @return the function return value
+             */
+            void callSync(const call_context &ctx, Args...args) {
+                auto future = this->call(ctx, std::forward<Args>(args)...);
+                if (ctx.has_deadline() && future.wait_until(ctx.deadline) == std::future_status::timeout) {
+                    throw ::napi_tools::exception("The call timed out");
+                }
+
+                return future.get();
+            }
+
+            /**
+             * Call the javascript function synchronously without queueing the call.
+             * Must be called on the javascript thread. A promise returned
+             * by the javascript function is not awaited.
+             *
+             * @param args the function arguments
+             */
+            void callDirect(Args...args) {
+                bool completed = false;
+                std::optional<::napi_tools::exception> error;
+                this->invokeDirect(std::forward<Args>(args)..., [&completed, &error](const napi_tools::exception *ex) {
+                    completed = true;
+                    if (ex) error.emplace(*ex);
+                });
+
+                if (error) {
+                    throw *error;
+                } else if (!completed) {
+                    // The call failed without an error being passed to it
+                    throw ::napi_tools::exception("An unknown error occurred");
+                }
+            }
+
+            /**
+             * Call the javascript function async.
+             *
+             * @param args the function arguments
+             * @param callback the function to call when the javascript function returned
+             * @param on_error the function to call if the call failed
+             */
+            template<class F, class E, class = std::enable_if_t<
+                    std::is_invocable_v<std::decay_t<F> &> &&
+                    std::is_invocable_v<std::decay_t<E> &, const ::napi_tools::exception &>>>
+            void operator()(Args...args, F &&callback, E &&on_error) {
+                this->call(std::forward<Args>(args)..., std::forward<F>(callback), std::forward<E>(on_error));
+            }
+
+            /**
+             * Call the javascript function.
+             * Example usage:<br>
+             *
+             * <p><code>
+             * std::promise&lt;int&gt; promise = callback();<br>
+             * std::future&lt;int&gt; fut = promise.get_future();<br>
+             * fut.wait();<br>
+             * int res = fut.get();
+             * </code></p>
+             *
+             * @param args the function arguments
+             * @return a promise to be resolved
+             */
+            std::future<void> operator()(Args...args) {
+                return this->call(std::forward<Args>(args)...);
+            }
+
+            /**
+             * Call the javascript function with a supplied promise.
+             * Example:<br>
+             *
+             * <p><code>
+             * std::promise&lt;int&gt; promise;<br>
+             * callback(promise);<br>
+             * std::future&lt;int&gt; future = promise.get_future();<br>
+             * int res = future.get();
+             * </p></code>
+             *
+             * @param args the function arguments
+             * @param promise the promise to be resolved
+             */
+            void operator()(Args...args, std::promise<void> &promise) {
+                this->call(std::forward<Args>(args)..., promise);
+            }
+
+            /**
+             * Call the javascript function async.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @param callback the function to call when the javascript function returned
+             * @param on_error the function to call if the call failed
+             */
+            template<class F, class E, class = std::enable_if_t<
+                    std::is_invocable_v<std::decay_t<F> &> &&
+                    std::is_invocable_v<std::decay_t<E> &, const ::napi_tools::exception &>>>
+            void operator()(const call_context &ctx, Args...args, F &&callback, E &&on_error) {
+                this->call(ctx, std::forward<Args>(args)..., std::forward<F>(callback), std::forward<E>(on_error));
+            }
+
+            /**
+             * Call the javascript function.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @return a promise to be resolved
+             */
+            std::future<void> operator()(const call_context &ctx, Args...args) {
+                return this->call(ctx, std::forward<Args>(args)...);
+            }
+
+#ifdef NAPI_TOOLS_COROUTINES
+            /**
+             * Call the javascript function from a coroutine.
+             * The call is queued once awaited. The callback
+             * must not be destroyed before the call is awaited.
+             * Example:<br>
+             *
+             * <p><code>
+             * co_await callback.async();
+             * </code></p>
+             *
+             * @param args the function arguments
+             * @return the awaitable call
+             */
+            [[nodiscard]] inline util::awaitable<javascriptCallback<void(Args...)>, void, Args...> async(Args...args) {
+                return {this, this->getExecutor(), call_context(), std::forward<Args>(args)...};
+            }
+
+            /**
+             * Call the javascript function from a coroutine.
+             * The coroutine is resumed with an exception if the context is cancelled.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @return the awaitable call
+             */
+            [[nodiscard]] inline util::awaitable<javascriptCallback<void(Args...)>, void, Args...>
+            async(const call_context &ctx, Args...args) {
+                return {this, this->getExecutor(), ctx, std::forward<Args>(args)...};
+            }
+#endif //NAPI_TOOLS_COROUTINES
+        };
+
+        /**
+         * A non-void javascript callback
+         *
+         * @tparam R the return type
+         * @tparam Args the argument types
+         */
+        template<class R, class...Args>
+        class callback<R(Args...)> : public util::callback_template<javascriptCallback<R(Args...)>, Args...> {
+        public:
+            using cb_template = util::callback_template<javascriptCallback<R(Args...)>, Args...>;
+            using cb_template::cb_template;
+
+            /**
+             * Call the javascript function async.
+             * The callback functions may be move-only.
+             *
+             * @param args the function arguments
+             * @param callback the function to pass the result of the javascript function to
+             * @param on_error the function to call if the call failed
+             */
+            template<class F, class E, class = std::enable_if_t<
+                    std::is_invocable_v<std::decay_t<F> &, R> &&
+                    std::is_invocable_v<std::decay_t<E> &, const ::napi_tools::exception &>>>
+            void call(Args...args, F &&callback, E &&on_error) {
+                this->call(call_context(), std::forward<Args>(args)..., std::forward<F>(callback),
+                           std::forward<E>(on_error));
+            }
+
+            /**
+             * Call the javascript function. Async call.
+             * The call is skipped and on_error is called if the context is cancelled.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @param callback the function to pass the result of the javascript function to
+             * @param on_error the function to call if the call failed
+             */
+            template<class F, class E, class = std::enable_if_t<
+                    std::is_invocable_v<std::decay_t<F> &, R> &&
+                    std::is_invocable_v<std::decay_t<E> &, const ::napi_tools::exception &>>>
+            void call(const call_context &ctx, Args...args, F &&callback, E &&on_error) {
+                if (util::is_empty(callback) || util::is_empty(on_error)) {
+                    throw std::runtime_error("The callback functions are not initialized");
+                }
+
+                this->enqueue(ctx, std::forward<Args>(args)..., util::make_completion<R>(std::forward<F>(callback),
+                                                                                         std::forward<E>(on_error)));
+            }
+
+            /**
+             * Call the javascript function.
+             *
+             * @param args the function arguments
+             * @return a promise to be resolved
+             */
+            std::future<R> call(Args...args) {
+                return this->call(call_context(), std::forward<Args>(args)...);
+            }
+
+            /**
+             * Call the javascript function.
+             * The call is skipped and the future fails if the context is cancelled.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @return a promise to be resolved
+             */
+            std::future<R> call(const call_context &ctx, Args...args) {
+                std::promise<R> promise;
+                std::future<R> future = promise.get_future();
+                this->enqueue(ctx, std::forward<Args>(args)..., [promise = std::move(promise)]
+                        (R *val, const napi_tools::exception *ex) mutable {
+                    if (ex) {
+                        promise.set_exception(std::make_exception_ptr(*ex));
+                    } else {
+                        promise.set_value(std::move(*val));
+                    }
+                });
+
+                return future;
+            }
+
+            /**
+             * Call the javascript function with a supplied promise.
+             *
+             * @param args the function arguments
+             * @param promise the promise to be resolved
+             */
+            void call(Args...args, std::promise<R> &promise) {
+                this->enqueue(call_context(), std::forward<Args>(args)..., [&promise](R *val, const napi_tools::exception *ex) {
+                    if (ex) {
+                        promise.set_exception(std::make_exception_ptr(*ex));
+                    } else {
+                        promise.set_value(std::move(*val));
+                    }
+                });
+            }
+
+            /**
+             * Call the javascript function and wait for it to finish
+             *
+             * @param args the function arguments
+             * @return the function return value
+             */
+            R callSync(Args...args) {
+                std::promise<R> promise;
+                std::future<R> future = promise.get_future();
+                this->call(std::forward<Args>(args)..., promise);
+
+                return future.get();
+            }
+
+            /**
+             * Call the javascript function and wait for it to finish.
+             * Throws if the context is cancelled before the function
+             * is called or the function did not return before the deadline.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @return the function return value
+             */
+            R callSync(const call_context &ctx, Args...args) {
+                auto future = this->call(ctx, std::forward<Args>(args)...);
+                if (ctx.has_deadline() && future.wait_until(ctx.deadline) == std::future_status::timeout) {
+                    throw ::napi_tools::exception("The call timed out");
+                }
+
+                return future.get();
+            }
+
+            /**
+             * Call the javascript function synchronously without queueing the call.
+             * Must be called on the javascript thread. A promise returned
+             * by the javascript function is not awaited.
+             *
+             * @param args the function arguments
+             * @return the function return value
+             */
+            R callDirect(Args...args) {
+                std::optional<R> result;
+                std::optional<::napi_tools::exception> error;
+                this->invokeDirect(std::forward<Args>(args)..., [&result, &error]
+                        (R *val, const napi_tools::exception *ex) {
+                    if (ex) {
+                        error.emplace(*ex);
+                    } else {
+                        result.emplace(std::move(*val));
+                    }
+                });
+
+                if (error) {
+                    throw *error;
+                } else if (!result) {
+                    // The call failed without an error being passed to it
+                    throw ::napi_tools::exception("An unknown error occurred");
+                }
+
+                return std::move(*result);
+            }
+
+            /**
+             * Call the javascript function async.
+             *
+             * @param args the function arguments
+             * @param callback the function to pass the result of the javascript function to
+             * @param on_error the function to call if the call failed
+             */
+            template<class F, class E, class = std::enable_if_t<
+                    std::is_invocable_v<std::decay_t<F> &, R> &&
+                    std::is_invocable_v<std::decay_t<E> &, const ::napi_tools::exception &>>>
+            void operator()(Args...args, F &&callback, E &&on_error) {
+                this->call(std::forward<Args>(args)..., std::forward<F>(callback), std::forward<E>(on_error));
+            }
+
+            /**
+             * Call the javascript function.
+             * Example usage:<br>
+             *
+             * <p><code>
+             * std::promise&lt;int&gt; promise = callback();<br>
+             * std::future&lt;int&gt; fut = promise.get_future();<br>
+             * fut.wait();<br>
+             * int res = fut.get();
+             * </code></p>
+             *
+             * @param args the function arguments
+             * @return a promise to be resolved
+             */
+            std::future<R> operator()(Args...args) {
+                return this->call(std::forward<Args>(args)...);
+            }
+
+            /**
+             * Call the javascript function with a supplied promise.
+             * Example:<br>
+             *
+             * <p><code>
+             * std::promise&lt;int&gt; promise;<br>
+             * callback(promise);<br>
+             * std::future&lt;int&gt; future = promise.get_future();<br>
+             * int res = future.get();
+             * </p></code>
+             *
+             * @param args the function arguments
+             * @param promise the promise to be resolved
+             */
+            void operator()(Args...args, std::promise<R> &promise) {
+                this->call(std::forward<Args>(args)..., promise);
+            }
+
+            /**
+             * Call the javascript function async.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @param callback the function to pass the result of the javascript function to
+             * @param on_error the function to call if the call failed
+             */
+            template<class F, class E, class = std::enable_if_t<
+                    std::is_invocable_v<std::decay_t<F> &, R> &&
+                    std::is_invocable_v<std::decay_t<E> &, const ::napi_tools::exception &>>>
+            void operator()(const call_context &ctx, Args...args, F &&callback, E &&on_error) {
+                this->call(ctx, std::forward<Args>(args)..., std::forward<F>(callback), std::forward<E>(on_error));
+            }
+
+            /**
+             * Call the javascript function.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @return a promise to be resolved
+             */
+            std::future<R> operator()(const call_context &ctx, Args...args) {
+                return this->call(ctx, std::forward<Args>(args)...);
+            }
+
+#ifdef NAPI_TOOLS_COROUTINES
+            /**
+             * Call the javascript function from a coroutine.
+             * The call is queued once awaited. The callback
+             * must not be destroyed before the call is awaited.
+             * Example:<br>
+             *
+             * <p><code>
+             * int res = co_await callback.async();
+             * </code></p>
+             *
+             * @param args the function arguments
+             * @return the awaitable call
+             */
+            [[nodiscard]] inline util::awaitable<javascriptCallback<R(Args...)>, R, Args...> async(Args...args) {
+                return {this, this->getExecutor(), call_context(), std::forward<Args>(args)...};
+            }
+
+            /**
+             * Call the javascript function from a coroutine.
+             * The coroutine is resumed with an exception if the context is cancelled.
+             *
+             * @param ctx the call context
+             * @param args the function arguments
+             * @return the awaitable call
+             */
+            [[nodiscard]] inline util::awaitable<javascriptCallback<R(Args...)>, R, Args...>
+            async(const call_context &ctx, Args...args) {
+                return {this, this->getExecutor(), ctx, std::forward<Args>(args)...};
+            }
+#endif //NAPI_TOOLS_COROUTINES
+        };
+
+        /**
+         * A callback passing every call to a set of javascript listeners.
+         * The arguments are converted once per call and passed to all listeners.
+         * A listener throwing does not prevent the other listeners from being called,
+         * the call fails with the error of the first failed listener once all
+         * listeners were called.
+         *
+         * @tparam T the function signature, must return void
+         */
+        template<class T>
+        class broadcast;
+
+        /**
+         * A callback passing every call to a set of javascript listeners
+         *
+         * @tparam Args the argument types
+         */
+        template<class...Args>
+        class broadcast<void(Args...)> : public callback<void(Args...)> {
+        public:
+            using callback_type = callback<void(Args...)>;
+
+            /**
+             * Create an empty broadcast callback
+             */
+            broadcast() noexcept: callback_type(), listeners(nullptr) {}
+
+            /**
+             * Create an empty broadcast callback
+             */
+            broadcast(std::nullptr_t) noexcept: callback_type(nullptr), listeners(nullptr) {}
+
+            /**
+             * Create a broadcast callback without any listeners.
+             * Must be called on the javascript thread.
+             *
+             * @param env the environment to work in
+             * @param converter an optional function to do the type conversions
+             * @param opts the dispatch options
+             */
+            explicit broadcast(const Napi::Env &env, const util::converter<Args...> &converter = nullptr,
+                               const options &opts = {})
+                    : broadcast(env, std::make_shared<listener_list>(), converter, opts) {}
+
+            /**
+             * Get a function adding a listener.
+             * Adding a listener twice has no effect.
+             *
+             * @param env the environment to run in
+             * @return the function
+             */
+            inline Napi::Function getAddListener(const Napi::Env &env) const {
+                return Napi::Function::New(env, [l = getListeners()](const Napi::CallbackInfo &info) {
+                    const Napi::Function fn = listener_list::getFunction(info);
+                    if (l->find(fn) == l->functions->end()) {
+                        auto functions = std::make_shared<typename listener_list::function_list>(*l->functions);
+                        functions->push_back(std::make_shared<Napi::FunctionReference>(Napi::Persistent(fn)));
+                        l->count = functions->size();
+                        l->functions = std::move(functions);
+                    }
+                });
+            }
+
+            /**
+             * Get a function removing a listener
+             *
+             * @param env the environment to run in
+             * @return the function
+             */
+            inline Napi::Function getRemoveListener(const Napi::Env &env) const {
+                return Napi::Function::New(env, [l = getListeners()](const Napi::CallbackInfo &info) {
+                    const auto it = l->find(listener_list::getFunction(info));
+                    if (it != l->functions->end()) {
+                        auto functions = std::make_shared<typename listener_list::function_list>(*l->functions);
+                        functions->erase(functions->begin() + (it - l->functions->begin()));
+                        l->count = functions->size();
+                        l->functions = std::move(functions);
+                    }
+                });
+            }
+
+            /**
+             * Export the functions adding and removing listeners
+             *
+             * @param env the environment to run in
+             * @param exports the exports object
+             * @param add_name the name of the function adding a listener
+             * @param remove_name the name of the function removing a listener
+             */
+            inline void exportListeners(const Napi::Env &env, Napi::Object &exports, const std::string &add_name,
+                                        const std::string &remove_name) const {
+                exports.Set(add_name, this->getAddListener(env));
+                exports.Set(remove_name, this->getRemoveListener(env));
+            }
+
+            /**
+             * Get the number of listeners
+             *
+             * @return the number of listeners
+             */
+            [[nodiscard]] inline size_t listenerCount() const {
+                return listeners ? listeners->count.load() : 0;
+            }
+
+        private:
+            // The listeners are set by the broadcast itself
+            using callback_type::getSetter;
+            using callback_type::exportSetter;
+
+            /**
+             * The listeners of a broadcast. Only used on the javascript thread.
+             * The list is replaced when listeners are added or removed, so an
+             * event iterates the list it started with without copying it.
+             */
+            struct listener_list {
+                using function_list = std::vector<std::shared_ptr<Napi::FunctionReference>>;
+
+                /**
+                 * Find a listener
+                 *
+                 * @param fn the listener function
+                 * @return the iterator pointing to the listener or functions->end()
                  */
-                explicit callback_template(const Napi::CallbackInfo &info,
-                                           const converter_func<Args...> &converter = nullptr)
-                        : ptr(new wrapper(info, converter)), converter(converter) {}
+                auto find(const Napi::Function &fn) const {
+                    return std::find_if(functions->begin(), functions->end(), [&fn](const auto &ref) {
+                        return ref->Value().StrictEquals(fn);
+                    });
+                }
+
+                /**
+                 * Get the listener function passed to addListener or removeListener
+                 *
+                 * @param info the callback info
+                 * @return the function
+                 */
+                static Napi::Function getFunction(const Napi::CallbackInfo &info) {
+                    if (info.Length() < 1 || !info[0].IsFunction()) {
+                        throw Napi::TypeError::New(info.Env(), "The listener must be a function");
+                    }
+
+                    return info[0].As<Napi::Function>();
+                }
+
+                std::shared_ptr<const function_list> functions = std::make_shared<const function_list>();
+                // The arguments of the current event, reused by all events
+                std::vector<napi_value> argv;
+                // The number of listeners, readable from any thread
+                std::atomic<size_t> count{0};
+            };
+
+            /**
+             * Create a broadcast callback
+             *
+             * @param env the environment to work in
+             * @param l the listener list
+             * @param converter the converter
+             * @param opts the dispatch options
+             */
+            broadcast(const Napi::Env &env, std::shared_ptr<listener_list> l,
+                      const util::converter<Args...> &converter, const options &opts)
+                    : callback_type(env, createDispatcher(env, l), converter, opts), listeners(std::move(l)) {}
+
+            /**
+             * Create the function called by the callback, passing
+             * the already converted arguments to all listeners
+             *
+             * @param env the environment to work in
+             * @param l the listener list
+             * @return the function
+             */
+            static Napi::Function createDispatcher(const Napi::Env &env, const std::shared_ptr<listener_list> &l) {
+                return Napi::Function::New(env, [l](const Napi::CallbackInfo &info) -> Napi::Value {
+                    NAPI_TOOLS_TRACE_SPAN("callback", "broadcast");
+                    // Take the argument buffer, so an event emitted by
+                    // a listener uses a buffer of its own
+                    std::vector<napi_value> args = std::move(l->argv);
+                    args.resize(info.Length());
+                    for (size_t i = 0; i < args.size(); i++) {
+                        args[i] = info[i];
+                    }
+
+                    // Listeners may add or remove listeners, which replaces the list
+                    const std::shared_ptr<const typename listener_list::function_list> functions = l->functions;
+                    size_t failed = 0;
+                    std::string message;
+                    for (const auto &fn: *functions) {
+                        try {
+                            fn->Call(args);
+                        } catch (const Napi::Error &e) {
+                            if (failed++ == 0) message = e.Message();
+                        }
+                    }
+
+                    l->argv = std::move(args);
+                    if (failed > 0) {
+                        throw Napi::Error::New(info.Env(), std::to_string(failed) + " of " +
+                                                           std::to_string(functions->size()) +
+                                                           " listeners failed. First error: " + message);
+                    }
+
+                    return info.Env().Undefined();
+                });
+            }
+
+            /**
+             * Get the listeners
+             *
+             * @return the listener list
+             */
+            const std::shared_ptr<listener_list> &getListeners() const {
+                if (!listeners) {
+                    throw std::runtime_error("The broadcast callback is not initialized");
+                }
+
+                return listeners;
+            }
+
+            std::shared_ptr<listener_list> listeners;
+        };
+
+        /**
+         * How a callback group chooses the callback to call
+         */
+        enum class balancing {
+            // Call the callbacks in turn
+            round_robin,
+            // Call the callback with the fewest pending calls
+            least_queued
+        };
 
-                /**
-                 * Construct a callback function
-                 *
-                 * @param env the environment to work in
-                 * @param func the function to call
-                 * @param converter an optional function to do the type conversions
-                 */
-                callback_template(const Napi::Env &env, const Napi::Function &func,
-                                  const converter_func<Args...> &converter = nullptr)
-                        : ptr(new wrapper(env, func, converter)), converter(converter) {}
+        /**
+         * A group of callbacks calling the same javascript handler registered
+         * in multiple environments, e.g. in multiple worker threads.
+         * Calls are spread across the callbacks of the group.
+         */
+        template<class>
+        class callback_group;
 
-                /**
-                 * Get the underlying promise
-                 *
-                 * @return the promise
-                 */
-                [[nodiscard]] inline Napi::Promise getPromise() const {
-                    if (ptr && !ptr->stopped) {
-                        return ptr->fn->getPromise();
-                    } else {
-                        throw std::runtime_error("Callback was never initialized");
+        /**
+         * A group of callbacks
+         *
+         * @tparam R the return type
+         * @tparam Args the argument types
+         */
+        template<class R, class...Args>
+        class callback_group<R(Args...)> {
+        public:
+            using callback_type = callback<R(Args...)>;
+
+            /**
+             * Create an empty callback group
+             *
+             * @param strategy how to choose the callback to call
+             * @param opts the dispatch options of the callbacks
+             */
+            explicit callback_group(balancing strategy = balancing::round_robin, const options &opts = {})
+                    : state(std::make_shared<group_state>()) {
+                state->strategy = strategy;
+                state->opts = opts;
+            }
+
+            /**
+             * Get the setter function for this group. The setter adds the function
+             * passed to it to the group, replacing the function previously set in
+             * the same environment. Functions are removed from the group once their
+             * environment shuts down.
+             *
+             * @param env the environment to run in
+             * @return the setter function
+             */
+            inline Napi::Function getSetter(const Napi::Env &env) {
+                return Napi::Function::New(env, [st = state](const Napi::CallbackInfo &info) {
+                    TRY
+                        callback_type cb(info, nullptr, st->opts);
+                        Napi::Promise promise = cb.getPromise();
+                        if (st->set(info.Env(), std::move(cb))) {
+                            // Remove the callback once the environment shuts down
+                            auto *data = new hook_data{st, info.Env()};
+                            napi_add_env_cleanup_hook(info.Env(), [](void *arg) {
+                                std::unique_ptr<hook_data> data(static_cast<hook_data *>(arg));
+                                if (auto s = data->st.lock()) {
+                                    s->remove(data->env);
+                                }
+                            }, data);
+                        }
+
+                        return promise;
+                    CATCH_EXCEPTIONS
+                });
+            }
+
+            /**
+             * Export the setter in the init function of every environment
+             *
+             * @param env the environment to run in
+             * @param exports the exports object. Will set the setter function at index name.
+             * @param name the name of the setter function
+             */
+            inline void exportSetter(const Napi::Env &env, Napi::Object &exports, const std::string &name) {
+                exports.Set(name, this->getSetter(env));
+            }
+
+            /**
+             * Get the number of callbacks in this group
+             *
+             * @return the number of callbacks
+             */
+            [[nodiscard]] inline size_t size() const {
+                const auto m = state->members.load();
+                return m ? m->size() : 0;
+            }
+
+            /**
+             * Choose the callback to call next. The callback is not copied,
+             * the returned pointer keeps the list of callbacks it was chosen from alive.
+             *
+             * @return the chosen callback
+             */
+            [[nodiscard]] inline std::shared_ptr<callback_type> next() const {
+                auto m = state->members.load();
+                if (!m || m->empty()) {
+                    throw std::runtime_error("The callback group is empty");
+                }
+
+                const size_t start = state->counter.fetch_add(1, std::memory_order_relaxed);
+                callback_type *chosen = nullptr;
+                size_t chosen_backlog = 0;
+                for (size_t i = 0; i < m->size(); i++) {
+                    callback_type &cb = (*m)[(start + i) % m->size()].cb;
+                    if (cb.stopped()) continue;
+                    if (state->strategy == balancing::round_robin) {
+                        return std::shared_ptr<callback_type>(std::move(m), &cb);
+                    }
+
+                    const size_t b = cb.getBacklog();
+                    if (chosen == nullptr || b < chosen_backlog) {
+                        chosen = &cb;
+                        chosen_backlog = b;
                     }
                 }
 
-                /**
-                 * Get the underlying promise
-                 *
-                 * @return the promise
-                 */
-                [[nodiscard]] inline operator Napi::Promise() const {
-                    return this->getPromise();
+                if (chosen == nullptr) {
+                    throw std::runtime_error("All callbacks of the group have been stopped");
                 }
 
-                /**
-                 * Get the underlying promise
-                 *
-                 * @return the promise
-                 */
-                [[nodiscard]] inline operator Napi::Value() const {
-                    return this->operator Napi::Promise();
+                return std::shared_ptr<callback_type>(std::move(m), chosen);
+            }
+
+            /**
+             * Call one of the callbacks of this group.
+             * Takes the same arguments as callback::call.
+             *
+             * @param args the arguments
+             * @return the result of callback::call
+             */
+            template<class...Ts>
+            inline auto call(Ts &&...args) {
+                return this->next()->call(std::forward<Ts>(args)...);
+            }
+
+            /**
+             * Call one of the callbacks of this group and wait for it to finish.
+             * Takes the same arguments as callback::callSync.
+             *
+             * @param args the arguments
+             * @return the function return value
+             */
+            template<class...Ts>
+            inline auto callSync(Ts &&...args) {
+                return this->next()->callSync(std::forward<Ts>(args)...);
+            }
+
+            /**
+             * Call one of the callbacks of this group.
+             * Takes the same arguments as callback::operator().
+             *
+             * @param args the arguments
+             * @return the result of callback::operator()
+             */
+            template<class...Ts>
+            inline auto operator()(Ts &&...args) {
+                return (*this->next())(std::forward<Ts>(args)...);
+            }
+
+            /**
+             * Stop all callbacks and remove them from the group
+             */
+            inline void stop() {
+                std::unique_lock<std::mutex> lock(state->mtx);
+                const auto m = state->members.exchange(nullptr);
+                lock.unlock();
+
+                if (m) {
+                    for (const member &mem: *m) {
+                        mem.cb.stop();
+                    }
                 }
+            }
+
+        private:
+            /**
+             * A callback of the group
+             */
+            struct member {
+                napi_env env;
+                // Calls are made through the shared, immutable member lists.
+                // The callback itself is safe to call from multiple threads.
+                mutable callback_type cb;
+            };
+
+            using member_list = std::vector<member>;
 
+            /**
+             * The state of the group, shared with the cleanup hooks
+             */
+            struct group_state {
                 /**
-                 * Get the setter function for this callback
+                 * Set the callback of an environment
                  *
-                 * @param env the environment to run in
-                 * @param setOnlyOnce whether to allow this callback to only get set once.
-                 *                      Will throw an exception when tried to set a second time.
-                 * @return the setter function
+                 * @param env the environment
+                 * @param cb the callback
+                 * @return true, if the environment had no callback yet
                  */
-                inline Napi::Function getSetter(const Napi::Env &env, bool setOnlyOnce = false) {
-                    return Napi::Function::New(env, [this, setOnlyOnce](const Napi::CallbackInfo &info) {
-                        if (setOnlyOnce && this->operator bool()) {
-                            throw Napi::Error::New(info.Env(),
-                                                   "Tried to set a callback twice, which was not allowed to be set twice");
-                        }
-                        TRY
-                            this->ptr.reset(new wrapper(info, converter));
-
-                            return this->getPromise();
-                        CATCH_EXCEPTIONS
+                bool set(napi_env env, callback_type cb) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    const auto old = members.load();
+                    auto res = std::make_shared<member_list>(old ? *old : member_list());
+                    auto it = std::find_if(res->begin(), res->end(), [env](const member &m) {
+                        return m.env == env;
                     });
+
+                    const bool added = it == res->end();
+                    if (added) {
+                        res->push_back(member{env, std::move(cb)});
+                    } else {
+                        it->cb = std::move(cb);
+                    }
+
+                    members.store(std::move(res));
+                    return added;
                 }
 
                 /**
-                 * Export the setter in the init function. Or wherever you like.
+                 * Remove the callback of an environment
                  *
-                 * @param env the environment to run in
-                 * @param exports the exports object. Will set the setter function at index name.
-                 * @param name the name of the setter function
-                 * @param setOnlyOnce whether to allow this callback to only get set once.
-                 *                      Will throw an exception when tried to set a second time.
+                 * @param env the environment
                  */
-                inline void exportSetter(const Napi::Env &env, Napi::Object &exports, const std::string &name,
-                                         bool setOnlyOnce = false) {
-                    exports.Set(name, this->getSetter(env, setOnlyOnce));
+                void remove(napi_env env) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    const auto old = members.load();
+                    if (!old) return;
+
+                    auto res = std::make_shared<member_list>(*old);
+                    res->erase(std::remove_if(res->begin(), res->end(), [env](const member &m) {
+                        return m.env == env;
+                    }), res->end());
+
+                    members.store(std::move(res));
                 }
 
-                /**
-                 * Check if the promise is initialized and not stopped
-                 *
-                 * @return true, if initialized and running
-                 */
-                [[nodiscard]] inline operator bool() const {
-                    return ptr && !ptr->stopped;
+                // Guards replacing the members
+                std::mutex mtx;
+                ::napi_tools::util::atomic_shared_ptr<const member_list> members;
+                mutable std::atomic<size_t> counter{0};
+                balancing strategy = balancing::round_robin;
+                options opts;
+            };
+
+            /**
+             * The data passed to the cleanup hook of an environment
+             */
+            struct hook_data {
+                std::weak_ptr<group_state> st;
+                napi_env env;
+            };
+
+            std::shared_ptr<group_state> state;
+        };
+    } // namespace callbacks
+
+    /**
+     * A namespace for streaming values to javascript
+     */
+    namespace streams {
+        /**
+         * A byte payload. Passed to javascript as a Buffer without copying.
+         */
+        using bytes = std::vector<uint8_t>;
+
+        /**
+         * The options of a channel
+         */
+        struct channel_options {
+            // The maximum number of buffered elements, or bytes for byte channels.
+            // Writers wait until javascript pulls elements once it is reached.
+            size_t capacity = 1024;
+            // The maximum number of elements passed to javascript per next() call
+            size_t max_chunk_size = 64;
+        };
+
+        /**
+         * A channel passing values written by c++ threads to javascript.
+         * Javascript reads the values using an async iterator, every call to
+         * next() returns an array of up to max_chunk_size buffered values:
+         *
+         * <p><code>
+         * for await (const chunk of channel) { ... }
+         * </code></p>
+         *
+         * next() optionally takes the number of elements (or bytes) javascript
+         * wants to read, the chunk is not filled beyond that if possible.
+         * Writers wait while the buffer is full, so producers are paused
+         * if javascript stops reading. Copies share the same channel.
+         *
+         * @tparam T the type of the values
+         */
+        template<class T>
+        class channel {
+            // The state shared by all copies of a channel
+            struct state;
+
+        public:
+            /**
+             * Create an empty channel
+             */
+            channel() noexcept = default;
+
+            /**
+             * Create an empty channel
+             */
+            channel(std::nullptr_t) noexcept {}
+
+            /**
+             * Create a channel. Must be called on the javascript thread.
+             *
+             * @param env the environment to work in
+             * @param opts the channel options
+             */
+            explicit channel(const Napi::Env &env, const channel_options &opts = {})
+                    : st(std::make_shared<state>(opts)) {
+                if (opts.capacity == 0 || opts.max_chunk_size == 0) {
+                    throw std::invalid_argument("The capacity and chunk size must not be zero");
                 }
 
+                // The function only wakes up the javascript thread, it does not keep
+                // the process alive unless javascript waits for values
+                st->ts_fn = Napi::ThreadSafeFunction::New(env, Napi::Function::New(env, [](const Napi::CallbackInfo &) {}),
+                                                          "napi_tools::channel", 0, 1,
+                                                          new std::shared_ptr<state>(st), FinalizerCallback,
+                                                          (void *) nullptr);
+                st->ts_fn.Unref(env);
+            }
+
+            /**
+             * Write a value. Waits while the buffer is full.
+             *
+             * @param value the value to write
+             * @return false, if the channel was closed or javascript stopped reading
+             */
+            bool write(T value) {
+                state &s = this->get();
+                const size_t w = weight(value);
+                std::unique_lock<std::mutex> lock(s.mtx);
+                s.space_cv.wait(lock, [&s, w] {
+                    return s.finished || s.cancelled || s.fits(w);
+                });
+
+                if (s.finished || s.cancelled) return false;
+                s.push(std::move(value), w);
+                return true;
+            }
+
+            /**
+             * Write a value if the buffer is not full
+             *
+             * @param value the value to write
+             * @return false, if the buffer is full or the channel was closed
+             */
+            bool tryWrite(T value) {
+                state &s = this->get();
+                const size_t w = weight(value);
+                std::unique_lock<std::mutex> lock(s.mtx);
+                if (s.finished || s.cancelled || !s.fits(w)) return false;
+
+                s.push(std::move(value), w);
+                return true;
+            }
+
+#ifdef NAPI_TOOLS_COROUTINES
+            /**
+             * A write suspending the awaiting coroutine while the buffer is full
+             */
+            class write_awaitable {
+            public:
+                write_awaitable(std::shared_ptr<state> s, T value, callbacks::executor exec)
+                        : s(std::move(s)), value(std::move(value)), exec(std::move(exec)) {}
+
+                write_awaitable(const write_awaitable &) = delete;
+
+                write_awaitable &operator=(const write_awaitable &) = delete;
+
                 /**
-                 * Check if the promise is not initialized or stopped
+                 * The write is never complete before being awaited
                  *
-                 * @return true, if not initialized or is stopped
+                 * @return false
                  */
-                [[nodiscard]] inline bool stopped() const {
-                    return !ptr || ptr->stopped;
+                [[nodiscard]] inline bool await_ready() const noexcept {
+                    return false;
                 }
 
                 /**
-                 * Stop the callback function and deallocate all resources
+                 * Write the value or suspend until there is space in the buffer
+                 *
+                 * @param h the handle of the awaiting coroutine
+                 * @return false, if the value was written or the channel is closed
                  */
-                inline void stop() {
-                    if (ptr && !ptr->stopped) {
-                        ptr->fn->stop();
-                        ptr->stopped = true;
+                inline bool await_suspend(std::coroutine_handle<> h) {
+                    handle = h;
+                    const size_t w = weight(value);
+                    // The coroutine may be resumed and destroyed before the lock is released
+                    const std::shared_ptr<state> keep = s;
+                    std::unique_lock<std::mutex> lock(keep->mtx);
+                    if (s->finished || s->cancelled) {
+                        written = false;
+                        return false;
+                    } else if (s->suspended.empty() && s->fits(w)) {
+                        s->push(std::move(value), w);
+                        written = true;
+                        return false;
                     }
+
+                    s->suspended.push_back(this);
+                    return true;
                 }
 
                 /**
-                 * Default destructor
+                 * Get the result of the write
+                 *
+                 * @return false, if the channel was closed or javascript stopped reading
                  */
-                inline ~callback_template() = default;
+                inline bool await_resume() const noexcept {
+                    return written;
+                }
+
+            private:
+                friend struct state;
 
-            protected:
                 /**
-                 * A class for wrapping around the javascriptCallback class
+                 * Resume the coroutine
                  */
-                class wrapper {
-                public:
-                    /**
-                     * Create a wrapper instance
-                     *
-                     * @param info the callbackInfo to construct the callback
-                     * @param converter an optional function to do the type conversions
-                     */
-                    explicit wrapper(const Napi::CallbackInfo &info, const converter_func<Args...> &converter)
-                            : fn(new T(info, converter)), stopped(false) {}
-
-                    /**
-                     * Create a wrapper instance
-                     *
-                     * @param env the environment to work in
-                     * @param func the function to wrap the callback around
-                     * @param converter an optional function to do the type conversions
-                     */
-                    wrapper(const Napi::Env &env, const Napi::Function &func, const converter_func<Args...> &converter)
-                            : fn(new T(env, func, converter)), stopped(false) {}
-
-                    /**
-                     * Stop the callback
-                     */
-                    ~wrapper() {
-                        if (!stopped) fn->stop();
-                        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                void resume() {
+                    if (exec) {
+                        exec(handle);
+                    } else {
+                        handle.resume();
                     }
+                }
 
-                    T *fn;
-                    bool stopped;
-                };
-
-                /**
-                 * The ptr holding the wrapper
-                 */
-                std::shared_ptr<wrapper> ptr;
-                util::converter_func<Args...> converter;
+                std::shared_ptr<state> s;
+                T value;
+                callbacks::executor exec;
+                std::coroutine_handle<> handle;
+                bool written = false;
             };
-        } // namespace util
 
-        /**
-         * A javascript callback
-         */
-        template<class>
-        class javascriptCallback;
+            /**
+             * Write a value, suspending the awaiting coroutine while the buffer is full.
+             * The coroutine is resumed using the executor once the value was written.
+             * If the executor is empty, the coroutine is resumed on the thread freeing
+             * space in the buffer, usually the javascript thread.
+             *
+             * @param value the value to write
+             * @param exec the executor to resume the coroutine on
+             * @return the awaitable write, resulting in false if the channel was closed
+             */
+            [[nodiscard]] write_awaitable writeAsync(T value, callbacks::executor exec = {}) {
+                this->get();
+                return write_awaitable(st, std::move(value), std::move(exec));
+            }
+#endif //NAPI_TOOLS_COROUTINES
 
-        /**
-         * A javascript callback with return type
-         *
-         * @tparam R the return type
-         * @tparam A the argument types
-         */
-        template<class R, class...A>
-        class javascriptCallback<R(A...)> {
-        public:
             /**
-             * Create a javascript callback
+             * Get the number of elements (or bytes) which can be written without waiting
              *
-             * @param info the callback info
-             * @param converter an optional function to do the type conversions
+             * @return the free capacity of the buffer
              */
-            explicit inline javascriptCallback(const Napi::CallbackInfo &info,
-                                               const util::converter_func<A...> &converter)
-                    : deferred(Napi::Promise::Deferred::New(info.Env())), mtx(), converter(converter) {
-                CHECK_ARGS(::napi_tools::napi_type::function);
-                Napi::Env env = info.Env();
+            [[nodiscard]] size_t credits() const {
+                state &s = this->get();
+                std::unique_lock<std::mutex> lock(s.mtx);
+                return s.finished || s.cancelled ? 0 : s.opts.capacity - std::min(s.buffered, s.opts.capacity);
+            }
 
-                run = true;
+            /**
+             * Check if the channel was closed or javascript stopped reading
+             *
+             * @return true, if no more values can be written
+             */
+            [[nodiscard]] bool closed() const {
+                state &s = this->get();
+                std::unique_lock<std::mutex> lock(s.mtx);
+                return s.finished || s.cancelled;
+            }
 
-                // Create a new ThreadSafeFunction.
-                this->ts_fn =
-                        Napi::ThreadSafeFunction::New(env, info[0].As<Napi::Function>(), "javascriptCallback", 0, 1,
-                                                      this, FinalizerCallback < R, A... >, (void *) nullptr);
-                this->nativeThread = std::thread(threadEntry < R, A... >, this);
+            /**
+             * Close the channel. Javascript still receives
+             * the buffered values, the iterator finishes afterwards.
+             */
+            void close() {
+                this->finish(std::nullopt);
             }
 
             /**
-             * Create a javascript callback
+             * Close the channel with an error. Javascript receives
+             * the buffered values, the next call to next() is rejected.
+             *
+             * @param message the error message
+             */
+            void fail(const std::string &message) {
+                this->finish(message);
+            }
+
+            /**
+             * Get the async iterator reading from this channel.
+             * Must be called on the javascript thread.
+             * The iterator has the properties highWaterMark and objectMode,
+             * which are used by streams.toReadable.
              *
              * @param env the environment to work in
-             * @param func the function to wrap the callback around
-             * @param converter an optional function to do the type conversions
+             * @return the async iterator
              */
-            javascriptCallback(const Napi::Env &env, const Napi::Function &func,
-                               const util::converter_func<A...> &converter)
-                    : deferred(Napi::Promise::Deferred::New(env)), mtx(), run(true), converter(converter) {
-                // Create a new ThreadSafeFunction.
-                this->ts_fn =
-                        Napi::ThreadSafeFunction::New(env, func, "javascriptCallback", 0, 1,
-                                                      this, FinalizerCallback < R, A... >, (void *) nullptr);
-                this->nativeThread = std::thread(threadEntry < R, A... >, this);
+            [[nodiscard]] Napi::Object getIterator(const Napi::Env &env) const {
+                std::shared_ptr<state> s = st;
+                if (!s) {
+                    throw std::runtime_error("The channel is not initialized");
+                }
+
+                Napi::Object iterator = Napi::Object::New(env);
+                iterator.Set("next", Napi::Function::New(env, [s](const Napi::CallbackInfo &info) -> Napi::Value {
+                    size_t limit = 0;
+                    if (info.Length() > 0 && info[0].IsNumber()) {
+                        limit = static_cast<size_t>(std::max(info[0].ToNumber().Int64Value(), int64_t(0)));
+                    }
+
+                    return s->next(info.Env(), limit);
+                }));
+                iterator.Set("return", Napi::Function::New(env, [s](const Napi::CallbackInfo &info) -> Napi::Value {
+                    return s->cancel(info.Env());
+                }));
+                iterator.Set(Napi::Symbol::WellKnown(env, "asyncIterator"),
+                             Napi::Function::New(env, [](const Napi::CallbackInfo &info) -> Napi::Value {
+                                 return info.This();
+                             }));
+                iterator.Set("highWaterMark", Napi::Number::New(env, static_cast<double>(s->opts.capacity)));
+                iterator.Set("objectMode", Napi::Boolean::New(env, !std::is_same_v<T, bytes>));
+
+                return iterator;
             }
 
             /**
-             * Async call the javascript function
+             * Convert a channel to its async iterator
              *
-             * @param values the values to pass to the function
-             * @param func the callback function
+             * @param env the environment to work in
+             * @param c the channel to convert
+             * @return the async iterator
              */
-            inline void asyncCall(A &&...values, const std::function<void(R)> &func, const error_func &on_error) {
-                std::unique_lock<std::mutex> lock(mtx);
-                queue.push_back(args(std::forward<A>(values)..., func, on_error, converter));
+            static Napi::Value toNapiValue(const Napi::Env &env, const channel<T> &c) {
+                return c.getIterator(env);
             }
 
+        private:
             /**
-             * Get the promise
+             * Get the weight of a value, counted against the capacity
              *
-             * @return the Napi::Promise
+             * @param value the value
+             * @return the number of bytes for byte payloads, 1 otherwise
              */
-            [[nodiscard]] inline Napi::Promise getPromise() const {
-                return deferred.Promise();
+            static size_t weight(const T &value) {
+                if constexpr (std::is_same_v<T, bytes>) {
+                    return value.size();
+                } else {
+                    return 1;
+                }
             }
 
             /**
-             * Stop the function
+             * Convert a value to javascript. Byte payloads
+             * are moved into a Buffer without copying them.
+             *
+             * @param env the environment to work in
+             * @param value the value to convert
+             * @return the converted value
              */
-            inline void stop() {
-                run = false;
-                //mtx.unlock();
+            static Napi::Value convert(const Napi::Env &env, T &&value) {
+                if constexpr (std::is_same_v<T, bytes>) {
+                    if (value.empty()) {
+                        return Napi::Buffer<uint8_t>::New(env, 0);
+                    }
+
+                    auto *data = new bytes(std::move(value));
+                    return Napi::Buffer<uint8_t>::New(env, data->data(), data->size(), [](Napi::Env, uint8_t *, bytes *b) {
+                        delete b;
+                    }, data);
+                } else {
+                    return ::napi_tools::util::conversions::cppValToValue(env, value);
+                }
             }
 
-        private:
             /**
-             * A class for storing arguments
+             * The state of a channel, shared by all copies and the iterator
              */
-            class args {
-            public:
+            struct state {
+                explicit state(const channel_options &opts) : opts(opts) {}
+
                 /**
-                 * Create a new args instance
+                 * Check if a value fits into the buffer. A value larger
+                 * than the capacity fits if the buffer is empty.
+                 * Must be called with the lock held.
                  *
-                 * @param values the values to store
-                 * @param func the callback function
-                 * @param converter an optional function to do the type conversions
+                 * @param w the weight of the value
+                 * @return true, if the value fits
                  */
-                inline explicit args(A &&...values, const std::function<void(R)> &func, error_func on_error,
-                                     const util::converter_func<A...> &converter)
-                        : args_t(std::forward<A>(values)...), fun(func), err(std::move(on_error)),
-                          converter(converter) {}
+                [[nodiscard]] bool fits(size_t w) const {
+                    return buffered == 0 || buffered + w <= opts.capacity;
+                }
 
                 /**
-                 * Convert the args to a napi_value vector.
-                 * Source: https://stackoverflow.com/a/42495119
+                 * Buffer a value and wake up the javascript thread.
+                 * Must be called with the lock held.
                  *
-                 * @param env the environment to work in
-                 * @return the value vector
+                 * @param value the value
+                 * @param w the weight of the value
                  */
-                inline std::vector<napi_value> to_vector(const Napi::Env &env) {
-                    if (converter) {
-                        return std::apply([&env, this](auto &&... el) {
-                            return converter(env, std::forward<decltype(el)>(el)...);
-                        }, std::forward<std::tuple<A...>>(args_t));
-                    } else {
-                        return std::apply([&env](auto &&... el) {
-                            return std::vector<napi_value>{
-                                    ::napi_tools::util::conversions::cppValToValue(env,
-                                                                                   std::forward<decltype(el)>(el))...};
-                        }, std::forward<std::tuple<A...>>(args_t));
+                void push(T &&value, size_t w) {
+                    buffer.push_back(std::move(value));
+                    buffered += w;
+                    this->schedule();
+                }
+
+                /**
+                 * Wake up the javascript thread if it waits for values.
+                 * Must be called with the lock held.
+                 */
+                void schedule() {
+                    if (waiting && !scheduled && !released) {
+                        scheduled = ts_fn.NonBlockingCall(this, [](Napi::Env env, Napi::Function, state *s) {
+                            {
+                                std::unique_lock<std::mutex> lock(s->mtx);
+                                s->scheduled = false;
+                            }
+
+                            s->drain(env);
+                        }) == napi_ok;
                     }
                 }
 
-                util::converter_func<A...> converter;
-                std::function<void(R)> fun;
-                error_func err;
-            private:
-                std::tuple<A...> args_t;
-            };
+                /**
+                 * Release the thread-safe function once all values were read.
+                 * Must be called with the lock held.
+                 */
+                void releaseIfDone() {
+                    if ((finished || cancelled) && buffer.empty() && !waiting && !released) {
+                        released = true;
+                        ts_fn.Release();
+                    }
+                }
 
-            // The thread entry
-            template<class U, class...Args>
-            static void threadEntry(javascriptCallback<U(Args...)> *jsCallback) {
-                // The callback function
-                const auto callback = [](const Napi::Env &env, const Napi::Function &jsCallback, args *data) {
-                    try {
-                        Napi::Value val = jsCallback.Call(data->to_vector(env));
-                        U ret = ::napi_tools::util::conversions::convertToCpp<U>(env, val);
-                        data->fun(ret);
-                    } catch (const Napi::Error &e) {
-                        try {
-                            auto ex = exception::from_napi_error(e);
-                            ex.add_to_stack("napi_tools::callbacks::javascriptCallback::threadEntry::callback",
-                                            __FILE__, __LINE__);
-                            data->err(ex);
-                        } catch (const std::exception &e) {
-                            std::cerr << __FILE__ << ":" << __LINE__ << " Exception thrown: " << e.what() << std::endl;
-                        } catch (...) {
-                            std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
-                        }
-                    } catch (const std::exception &e) {
-                        try {
-                            data->err(exception(e.what()));
-                        } catch (const std::exception &e) {
-                            std::cerr << __FILE__ << ":" << __LINE__ << " Exception thrown: " << e.what() << std::endl;
-                        } catch (...) {
-                            std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
+#ifdef NAPI_TOOLS_COROUTINES
+                /**
+                 * Move the values of suspended writers into the buffer
+                 * while they fit. Must be called with the lock held.
+                 *
+                 * @return the writers to resume
+                 */
+                std::vector<write_awaitable *> admit() {
+                    std::vector<write_awaitable *> res;
+                    while (!suspended.empty()) {
+                        write_awaitable *w = suspended.front();
+                        if (finished || cancelled) {
+                            w->written = false;
+                        } else if (this->fits(weight(w->value))) {
+                            this->push(std::move(w->value), weight(w->value));
+                            w->written = true;
+                        } else {
+                            break;
                         }
-                    } catch (...) {
-                        std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
+
+                        suspended.pop_front();
+                        res.push_back(w);
                     }
-                    delete data;
-                };
 
-                while (jsCallback->run) {
-                    // Lock the mutex
-                    std::unique_lock<std::mutex> lock(jsCallback->mtx);
-                    // Check if run is still true.
-                    // Run may be false as the mutex is unlocked when stop() is called
-                    if (jsCallback->run) {
-                        for (const args &ar: jsCallback->queue) {
-                            // Copy the arguments
-                            auto *a = new args(ar);
-
-                            // Call the callback
-                            napi_status status = jsCallback->ts_fn.BlockingCall(a, callback);
-
-                            if (status != napi_ok) {
-                                Napi::Error::Fatal("ThreadEntry",
-                                                   "Napi::ThreadSafeNapi::Function.BlockingCall() failed");
+                    return res;
+                }
+#endif //NAPI_TOOLS_COROUTINES
+
+                /**
+                 * Wake up writers waiting for space. Must be called without the lock held.
+                 */
+                void wakeWriters() {
+                    space_cv.notify_all();
+#ifdef NAPI_TOOLS_COROUTINES
+                    std::unique_lock<std::mutex> lock(mtx);
+                    const std::vector<write_awaitable *> resume = this->admit();
+                    lock.unlock();
+
+                    for (write_awaitable *w: resume) {
+                        w->resume();
+                    }
+#endif //NAPI_TOOLS_COROUTINES
+                }
+
+                /**
+                 * Take the next chunk of values from the buffer.
+                 * Must be called with the lock held.
+                 *
+                 * @param limit the number of elements or bytes requested, 0 if unlimited
+                 * @return the chunk
+                 */
+                std::vector<T> take(size_t limit) {
+                    std::vector<T> chunk;
+                    size_t taken = 0;
+                    while (!buffer.empty() && chunk.size() < opts.max_chunk_size && (limit == 0 || taken < limit)) {
+                        const size_t w = weight(buffer.front());
+                        taken += w;
+                        buffered -= w;
+                        chunk.push_back(std::move(buffer.front()));
+                        buffer.pop_front();
+                    }
+
+                    return chunk;
+                }
+
+                /**
+                 * Create an iterator result
+                 *
+                 * @param env the environment to work in
+                 * @param value the value, undefined if done
+                 * @param done whether the iterator is done
+                 * @return the result object
+                 */
+                static Napi::Object result(const Napi::Env &env, const Napi::Value &value, bool done) {
+                    Napi::Object res = Napi::Object::New(env);
+                    res.Set("value", value);
+                    res.Set("done", Napi::Boolean::New(env, done));
+                    return res;
+                }
+
+                /**
+                 * Settle the waiting next() calls with the buffered values.
+                 * Called on the javascript thread.
+                 *
+                 * @param env the environment to work in
+                 */
+                void drain(const Napi::Env &env) {
+                    NAPI_TOOLS_TRACE_SPAN("stream", "drain");
+                    std::unique_lock<std::mutex> lock(mtx);
+                    while (!waiters.empty()) {
+                        if (!buffer.empty()) {
+                            std::vector<T> chunk = this->take(waiters.front().limit);
+                            lock.unlock();
+                            this->wakeWriters();
+
+                            Napi::Array values = Napi::Array::New(env, chunk.size());
+                            for (size_t i = 0; i < chunk.size(); i++) {
+                                values.Set(static_cast<uint32_t>(i), convert(env, std::move(chunk[i])));
+                            }
+
+                            Napi::Promise::Deferred deferred = waiters.front().deferred;
+                            waiters.pop_front();
+                            deferred.Resolve(result(env, values, false));
+                        } else if (finished || cancelled) {
+                            std::optional<std::string> err;
+                            if (!cancelled) err.swap(error);
+                            lock.unlock();
+
+                            Napi::Promise::Deferred deferred = waiters.front().deferred;
+                            waiters.pop_front();
+                            if (err) {
+                                deferred.Reject(Napi::Error::New(env, *err).Value());
+                            } else {
+                                deferred.Resolve(result(env, env.Undefined(), true));
                             }
+                        } else {
+                            break;
                         }
 
-                        // Clear the queue and unlock the mutex
-                        jsCallback->queue.clear();
-                        lock.unlock();
+                        lock.lock();
+                    }
 
-                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                    } else {
-                        lock.unlock();
+                    waiting = !waiters.empty();
+                    if (!waiting && referenced && !released) {
+                        ts_fn.Unref(env);
+                        referenced = false;
                     }
+
+                    this->releaseIfDone();
                 }
 
-                jsCallback->ts_fn.Release();
-            }
+                /**
+                 * Get the next chunk. Called by the iterator's next().
+                 *
+                 * @param env the environment to work in
+                 * @param limit the number of elements or bytes requested, 0 if unlimited
+                 * @return a promise resolved with the iterator result
+                 */
+                Napi::Value next(const Napi::Env &env, size_t limit) {
+                    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+                    waiters.push_back(waiter{deferred, limit});
+
+                    std::unique_lock<std::mutex> lock(mtx);
+                    waiting = true;
+                    if (!referenced && !released) {
+                        // Keep the process alive while javascript waits for values
+                        ts_fn.Ref(env);
+                        referenced = true;
+                    }
+                    lock.unlock();
 
-            // The finalizer callback
-            template<class U, class...Args>
-            static void FinalizerCallback(const Napi::Env &env, void *, javascriptCallback<U(Args...)> *jsCallback) {
-                // Join the native thread and resolve the promise
-                jsCallback->nativeThread.join();
-                jsCallback->deferred.Resolve(env.Null());
+                    this->drain(env);
+                    return deferred.Promise();
+                }
 
-                delete jsCallback;
-            }
+                /**
+                 * Stop reading. Called by the iterator's return(),
+                 * e.g. if a for await loop is left early.
+                 *
+                 * @param env the environment to work in
+                 * @return a promise resolved with the final iterator result
+                 */
+                Napi::Value cancel(const Napi::Env &env) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cancelled = true;
+                    buffer.clear();
+                    buffered = 0;
+                    lock.unlock();
+                    this->wakeWriters();
+
+                    this->drain(env);
+                    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+                    deferred.Resolve(result(env, env.Undefined(), true));
+                    return deferred.Promise();
+                }
 
-            /**
-             * The destructor
-             */
-            ~javascriptCallback() noexcept = default;
+                /**
+                 * A pending next() call
+                 */
+                struct waiter {
+                    Napi::Promise::Deferred deferred;
+                    size_t limit;
+                };
 
-            // Whether the callback thread should run
-            bool run;
-            std::mutex mtx;
-            std::vector<args> queue;
-            const Napi::Promise::Deferred deferred;
-            std::thread nativeThread;
-            Napi::ThreadSafeFunction ts_fn;
-            util::converter_func<A...> converter;
-        };
+                channel_options opts;
+                std::mutex mtx;
+                // Signalled when values were read or the channel was closed
+                std::condition_variable space_cv;
+                std::deque<T> buffer;
+                // The weight of the buffered values
+                size_t buffered = 0;
+#ifdef NAPI_TOOLS_COROUTINES
+                // The coroutines waiting for space in the buffer
+                std::deque<write_awaitable *> suspended;
+#endif //NAPI_TOOLS_COROUTINES
+                // The error to reject the next read with
+                std::optional<std::string> error;
+                // Set once the writer closed the channel
+                bool finished = false;
+                // Set once javascript stopped reading or the environment shut down
+                bool cancelled = false;
+                // Whether javascript waits for values
+                bool waiting = false;
+                // Whether the javascript thread was woken up already
+                bool scheduled = false;
+                // Whether the thread-safe function was released or finalized
+                bool released = false;
+                Napi::ThreadSafeFunction ts_fn;
+
+                // Only accessed on the javascript thread
+                std::deque<waiter> waiters;
+                bool referenced = false;
+            };
 
-        /**
-         * A void javascript callback
-         *
-         * @tparam A the argument types
-         */
-        template<class...A>
-        class javascriptCallback<void(A...)> {
-        public:
             /**
-             * Create a javascript callback
+             * Close the channel
              *
-             * @param info the CallbackInfo. info[0] must be a napi function
-             * @param converter an optional function to do the type conversions
+             * @param err the error to pass to javascript, if any
              */
-            explicit inline javascriptCallback(const Napi::CallbackInfo &info,
-                                               const util::converter_func<A...> &converter)
-                    : deferred(Napi::Promise::Deferred::New(info.Env())), queue(), mtx(), converter(converter) {
-                CHECK_ARGS(::napi_tools::napi_type::function);
-                Napi::Env env = info.Env();
-
-                run = true;
+            void finish(std::optional<std::string> err) {
+                state &s = this->get();
+                std::unique_lock<std::mutex> lock(s.mtx);
+                if (!s.finished) {
+                    s.finished = true;
+                    s.error = std::move(err);
+                    s.schedule();
+                    s.releaseIfDone();
+                }
 
-                // Create a new ThreadSafeFunction.
-                this->ts_fn = Napi::ThreadSafeFunction::New(env, info[0].As<Napi::Function>(), "javascriptCallback", 0,
-                                                            1, this,
-                                                            FinalizerCallback < A... >, (void *) nullptr);
-                this->nativeThread = std::thread(threadEntry < A... >, this);
+                lock.unlock();
+                s.wakeWriters();
             }
 
             /**
-             * Create a javascript callback
+             * Get the state
              *
-             * @param env the environment to work in
-             * @param func the function to wrap the callback around
-             * @param converter an optional function to do the type conversions
+             * @return the state
              */
-            javascriptCallback(const Napi::Env &env, const Napi::Function &func,
-                               const util::converter_func<A...> &converter)
-                    : deferred(Napi::Promise::Deferred::New(env)), queue(), mtx(), run(true), converter(converter) {
-                // Create a new ThreadSafeFunction.
-                this->ts_fn = Napi::ThreadSafeFunction::New(env, func, "javascriptCallback", 0,
-                                                            1, this,
-                                                            FinalizerCallback < A... >, (void *) nullptr);
-                this->nativeThread = std::thread(threadEntry < A... >, this);
-            }
+            state &get() const {
+                if (!st) {
+                    throw std::runtime_error("The channel is not initialized");
+                }
 
-            /**
-             * Async call the function
-             *
-             * @param values the values to pass
-             */
-            inline void asyncCall(A &&...values, const std::function<void()> &callback, const error_func &on_error) {
-                std::unique_lock<std::mutex> lock(mtx);
-                queue.push_back(args(std::forward<A>(values)..., callback, on_error, converter));
+                return *st;
             }
 
             /**
-             * Get the napi promise
+             * Called once the thread-safe function is finalized,
+             * either after it was released or the environment shut down
              *
-             * @return the promise
+             * @param ctx the state
              */
-            [[nodiscard]] inline Napi::Promise getPromise() const {
-                return deferred.Promise();
+            static void FinalizerCallback(Napi::Env, void *, std::shared_ptr<state> *ctx) {
+                std::unique_ptr<std::shared_ptr<state>> s(ctx);
+                std::unique_lock<std::mutex> lock((*s)->mtx);
+                (*s)->released = true;
+                (*s)->cancelled = true;
+                lock.unlock();
+                (*s)->wakeWriters();
             }
 
-            /**
-             * Stop the function and deallocate all resources
-             */
-            inline void stop() {
-                run = false;
-                //mtx.unlock();
-            }
+            std::shared_ptr<state> st;
+        };
 
-        private:
+        /**
+         * The options of a sink
+         */
+        struct sink_options {
+            // The highWaterMark of the stream, the number of bytes javascript
+            // buffers while the consumer holds a batch before write() returns false
+            size_t capacity = 64 * 1024;
+        };
+
+        /**
+         * A sink passing Buffers written by javascript to a c++ consumer thread.
+         * Javascript writes to the sink using a Writable stream created by
+         * streams.toWritable, the consumer reads batches of chunks using read().
+         * The chunks point into the javascript Buffers, which are kept alive
+         * until the consumer destroys the batch. Copies share the same sink.
+         *
+         * The write callback of a batch is called once the consumer destroyed it,
+         * so javascript may reuse the Buffers once they were written. The stream
+         * buffers further chunks meanwhile, so the consumer must destroy a batch
+         * before reading the next one.
+         */
+        class sink {
+            // The state shared by all copies of a sink
+            struct state;
+
+        public:
             /**
-             * A class for storing arguments
+             * A batch of chunks written by javascript at once.
+             * The chunks are valid until the batch is destroyed.
              */
-            class args {
+            class batch {
             public:
-                /**
-                 * Create the args class
-                 *
-                 * @param values the values to store
-                 * @param converter an optional function to do the type conversions
-                 */
-                explicit args(A &&...values, std::function<void()> func, error_func on_error,
-                              const util::converter_func<A...> &converter)
-                        : args_t(std::forward<A>(values)...), fun(std::move(func)), err(std::move(on_error)),
-                          converter(converter) {}
+                batch(batch &&other) noexcept : st(std::move(other.st)), data(std::exchange(other.data, {})) {}
 
                 /**
-                 * Convert the args to a napi_value vector.
-                 * Source: https://stackoverflow.com/a/42495119
+                 * Move a batch into this one. The batch held
+                 * before is released like it was destroyed.
                  *
-                 * @param env the environment to work in
-                 * @return the value vector
+                 * @param other the batch to move
+                 * @return this batch
                  */
-                inline std::vector<napi_value> to_vector(const Napi::Env &env) {
-                    if (converter) {
-                        return std::apply([&env, this](auto &&... el) {
-                            return converter(env, std::forward<decltype(el)>(el)...);
-                        }, std::forward<std::tuple<A...>>(args_t));
-                    } else {
-                        return std::apply([&env](auto &&... el) {
-                            return std::vector<napi_value>{
-                                    ::napi_tools::util::conversions::cppValToValue(env,
-                                                                                   std::forward<decltype(el)>(el))...};
-                        }, std::forward<std::tuple<A...>>(args_t));
+                batch &operator=(batch &&other) noexcept {
+                    if (this != &other) {
+                        if (st) st->release(std::move(data));
+                        st = std::move(other.st);
+                        data = std::exchange(other.data, {});
                     }
+
+                    return *this;
                 }
 
-                std::function<void()> fun;
-                error_func err;
-            private:
-                util::converter_func<A...> converter;
-                std::tuple<A...> args_t;
-            };
+                batch(const batch &) = delete;
 
-            // The thread entry
-            template<class...Args>
-            static void threadEntry(javascriptCallback<void(Args...)> *jsCallback) {
-                // A callback function
-                const auto callback = [](const Napi::Env &env, const Napi::Function &jsCallback, args *data) {
-                    try {
-                        jsCallback.Call(data->to_vector(env));
-                        data->fun();
-                    } catch (const Napi::Error &e) {
-                        try {
-                            auto ex = exception::from_napi_error(e);
-                            ex.add_to_stack("napi_tools::callbacks::javascriptCallback::threadEntry::callback",
-                                            __FILE__, __LINE__);
-                            data->err(ex);
-                        } catch (const std::exception &e) {
-                            std::cerr << __FILE__ << ":" << __LINE__ << " Exception thrown: " << e.what() << std::endl;
-                        } catch (...) {
-                            std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
-                        }
-                    } catch (const std::exception &e) {
-                        try {
-                            data->err(exception(e.what()));
-                        } catch (const std::exception &e) {
-                            std::cerr << __FILE__ << ":" << __LINE__ << " Exception thrown: " << e.what() << std::endl;
-                        } catch (...) {
-                            std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
-                        }
-                    } catch (...) {
-                        std::cerr << __FILE__ << ":" << __LINE__ << " Unknown exception thrown" << std::endl;
-                    }
-                    delete data;
-                };
+                batch &operator=(const batch &) = delete;
 
-                while (jsCallback->run) {
-                    std::unique_lock<std::mutex> lock(jsCallback->mtx);
-                    // Check if run is still true,
-                    // as the mutex is unlocked when stop() is called
-                    if (jsCallback->run) {
-                        // Go through all args in the queue
-                        for (const args &val: jsCallback->queue) {
-                            // Copy the args class
-                            args *tmp = new args(val);
-
-                            // Call the callback
-                            napi_status status = jsCallback->ts_fn.BlockingCall(tmp, callback);
-
-                            // Check the status
-                            if (status != napi_ok) {
-                                Napi::Error::Fatal("ThreadEntry",
-                                                   "Napi::ThreadSafeNapi::Function.BlockingCall() failed");
-                            }
-                        }
+                /**
+                 * Get the chunks of this batch
+                 *
+                 * @return the chunks
+                 */
+                [[nodiscard]] const std::vector<std::span<const uint8_t>> &chunks() const noexcept {
+                    return data.chunks;
+                }
 
-                        // Clear the queue
-                        jsCallback->queue.clear();
-                        lock.unlock();
+                [[nodiscard]] auto begin() const noexcept {
+                    return data.chunks.begin();
+                }
 
-                        // Sleep for some time
-                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                    } else {
-                        lock.unlock();
-                    }
+                [[nodiscard]] auto end() const noexcept {
+                    return data.chunks.end();
                 }
 
-                // Release the thread-safe function
-                jsCallback->ts_fn.Release();
-            }
+                /**
+                 * Get the number of bytes in this batch
+                 *
+                 * @return the number of bytes
+                 */
+                [[nodiscard]] size_t bytes() const noexcept {
+                    return data.bytes;
+                }
 
-            // The finalizer callback
-            template<class...Args>
-            static void FinalizerCallback(const Napi::Env &env, void *, javascriptCallback<void(Args...)> *jsCallback) {
-                // Join the native thread and resolve the promise
-                jsCallback->nativeThread.join();
-                jsCallback->deferred.Resolve(env.Null());
+                /**
+                 * Release the Buffers of this batch
+                 */
+                ~batch() {
+                    if (st) st->release(std::move(data));
+                }
 
-                delete jsCallback;
-            }
+            private:
+                friend class sink;
+
+                /**
+                 * The chunks of a batch, the references to their Buffers
+                 * and the write callback to call once the batch was released
+                 */
+                struct contents {
+                    std::vector<std::span<const uint8_t>> chunks;
+                    std::vector<napi_ref> refs;
+                    napi_ref callback = nullptr;
+                    size_t bytes = 0;
+                };
 
-            // Default destructor
-            ~javascriptCallback() noexcept = default;
+                batch(std::shared_ptr<state> st, contents data) : st(std::move(st)), data(std::move(data)) {}
 
-            bool run;
-            std::mutex mtx;
-            std::vector<args> queue;
-            const Napi::Promise::Deferred deferred;
-            std::thread nativeThread;
-            Napi::ThreadSafeFunction ts_fn;
-            util::converter_func<A...> converter;
-        };
+                std::shared_ptr<state> st;
+                contents data;
+            };
 
-        /**
-         * A class for creating javascript callbacks
-         */
-        template<class>
-        class callback;
+            /**
+             * Create an empty sink
+             */
+            sink() noexcept = default;
 
-        /**
-         * A void javascript callback
-         *
-         * @tparam Args the argument types
-         */
-        template<class...Args>
-        class callback<void(Args...)> : public util::callback_template<javascriptCallback<void(Args...)>, Args...> {
-        public:
-            using cb_template = util::callback_template<javascriptCallback<void(Args...)>, Args...>;
-            using cb_template::cb_template;
+            /**
+             * Create an empty sink
+             */
+            sink(std::nullptr_t) noexcept {}
 
             /**
-             * Call the javascript function. Async call.
+             * Create a sink. Must be called on the javascript thread.
              *
-             * @param args the function arguments
+             * @param env the environment to work in
+             * @param opts the sink options
              */
-            inline void call(Args...args, const std::function<void()> &callback,
-                             const callbacks::error_func &on_error) {
-                if (!callback || !on_error) {
-                    throw std::runtime_error("The callback functions are not initialized");
+            explicit sink(const Napi::Env &env, const sink_options &opts = {}) : st(std::make_shared<state>(opts)) {
+                if (opts.capacity == 0) {
+                    throw std::invalid_argument("The capacity must not be zero");
                 }
 
-                if (this->ptr && !this->ptr->stopped) {
-                    this->ptr->fn->asyncCall(std::forward<Args>(args)..., callback, on_error);
-                } else {
-                    throw std::runtime_error("Callback was never initialized");
-                }
+                st->ts_fn = Napi::ThreadSafeFunction::New(env, Napi::Function::New(env, [](const Napi::CallbackInfo &) {}),
+                                                          "napi_tools::sink", 0, 1,
+                                                          new std::shared_ptr<state>(st), FinalizerCallback,
+                                                          (void *) nullptr);
+                st->ts_fn.Unref(env);
             }
 
             /**
-             * Call the javascript function.
+             * Read the next batch. Waits until javascript wrote data.
              *
-             * @param args the function arguments
-             * @return a promise to be resolved
+             * @return the next batch or std::nullopt if the stream ended
              */
-            std::future<void> call(Args...args) {
-                std::shared_ptr<std::promise<void>> promise = std::make_shared<std::promise<void>>();
-                this->operator()(args..., [promise]() {
-                    promise->set_value();
-                }, [promise](const napi_tools::exception &e) {
-                    promise->set_exception(std::make_exception_ptr(e));
+            std::optional<batch> read() {
+                state &s = this->get();
+                std::unique_lock<std::mutex> lock(s.mtx);
+                s.data_cv.wait(lock, [&s] {
+                    return !s.queue.empty() || s.finished || s.cancelled;
                 });
 
-                return promise->get_future();
+                return this->pop();
             }
 
             /**
-             * Call the javascript function with a supplied promise.
+             * Read the next batch if javascript wrote data
              *
-             * @param args the function arguments
-             * @param promise the promise to be resolved
+             * @return the next batch or std::nullopt if no data is available
              */
-            void call(Args...args, std::promise<void> &promise) {
-                this->operator()(args..., [&promise]() {
-                    promise.set_value();
-                }, [&promise](const std::exception &e) {
-                    promise.set_exception(std::make_exception_ptr(e));
-                });
+            std::optional<batch> tryRead() {
+                state &s = this->get();
+                std::unique_lock<std::mutex> lock(s.mtx);
+                return this->pop();
             }
 
             /**
-             * Call the javascript function and wait for it to finish
+             * Check if the stream ended and all batches were read
              *
-             * @param args the function arguments
-             * @return the function return value
+             * @return true, if no more batches will be available
              */
-            void callSync(Args...args) {
-                std::promise<void> promise;
-                std::future<void> future = promise.get_future();
-                this->call(std::forward<Args>(args)..., promise);
-
-                return future.get();
+            [[nodiscard]] bool ended() const {
+                state &s = this->get();
+                std::unique_lock<std::mutex> lock(s.mtx);
+                return s.cancelled || (s.finished && s.queue.empty());
             }
 
             /**
-             * Call the javascript function async.
+             * Fail the stream. Javascript receives the error
+             * once it writes again or waits for the consumer.
              *
-             * @param args the function arguments
-             * @param callback the callback function to be called, as this is async
+             * @param message the error message
              */
-            void operator()(Args...args, const std::function<void()> &callback,
-                            const callbacks::error_func &on_error) {
-                this->call(args..., callback, on_error);
+            void fail(const std::string &message) {
+                state &s = this->get();
+                std::unique_lock<std::mutex> lock(s.mtx);
+                if (!s.error) {
+                    s.error = message;
+                    s.schedule();
+                }
             }
 
             /**
-             * Call the javascript function.
-             * Example usage:<br>
+             * Get the object javascript writes to, pass it to streams.toWritable.
+             * Must be called on the javascript thread.
              *
-             * <p><code>
-             * std::promise&lt;int&gt; promise = callback();<br>
-             * std::future&lt;int&gt; fut = promise.get_future();<br>
-             * fut.wait();<br>
-             * int res = fut.get();
-             * </code></p>
-             *
-             * @param args the function arguments
-             * @return a promise to be resolved
+             * @param env the environment to work in
+             * @return the writer object
              */
-            std::future<void> operator()(Args...args) {
-                return this->call(args...);
+            [[nodiscard]] Napi::Object getWriter(const Napi::Env &env) const {
+                std::shared_ptr<state> s = st;
+                if (!s) {
+                    throw std::runtime_error("The sink is not initialized");
+                }
+
+                Napi::Object writer = Napi::Object::New(env);
+                writer.Set("write", Napi::Function::New(env, [s](const Napi::CallbackInfo &info) {
+                    s->write(info);
+                }));
+                writer.Set("end", Napi::Function::New(env, [s](const Napi::CallbackInfo &info) -> Napi::Value {
+                    return Napi::Boolean::New(info.Env(), s->end(info));
+                }));
+                writer.Set("abort", Napi::Function::New(env, [s](const Napi::CallbackInfo &info) {
+                    s->abort(info.Env());
+                }));
+                writer.Set("highWaterMark", Napi::Number::New(env, static_cast<double>(s->opts.capacity)));
+
+                return writer;
             }
 
             /**
-             * Call the javascript function with a supplied promise.
-             * Example:<br>
-             *
-             * <p><code>
-             * std::promise&lt;int&gt; promise;<br>
-             * callback(promise);<br>
-             * std::future&lt;int&gt; future = promise.get_future();<br>
-             * int res = future.get();
-             * </p></code>
+             * Convert a sink to its writer object
              *
-             * @param args the function arguments
-             * @param promise the promise to be resolved
+             * @param env the environment to work in
+             * @param s the sink to convert
+             * @return the writer object
              */
-            void operator()(Args...args, std::promise<void> &promise) {
-                this->call(args..., promise);
+            static Napi::Value toNapiValue(const Napi::Env &env, const sink &s) {
+                return s.getWriter(env);
             }
-        };
-
-        /**
-         * A non-void javascript callback
-         *
-         * @tparam R the return type
-         * @tparam Args the argument types
-         */
-        template<class R, class...Args>
-        class callback<R(Args...)> : public util::callback_template<javascriptCallback<R(Args...)>, Args...> {
-        public:
-            using cb_template = util::callback_template<javascriptCallback<R(Args...)>, Args...>;
-            using cb_template::cb_template;
 
+        private:
             /**
-             * Call the javascript function async.
-             *
-             * @param args the function arguments
-             * @param callback the callback function to be called, as this is async
+             * The state of a sink
              */
-            void call(Args...args, const std::function<void(R)> &callback, const callbacks::error_func &on_error) {
-                if (!callback || !on_error) {
-                    throw std::runtime_error("The callback functions are not initialized");
+            struct state {
+                explicit state(const sink_options &opts) : opts(opts) {}
+
+                /**
+                 * Queue a batch of Buffers. Called by the writer's write().
+                 *
+                 * @param info the callback info, info[0] is an array of Buffers,
+                 *             info[1] the function to call once the consumer released the batch
+                 */
+                void write(const Napi::CallbackInfo &info) {
+                    const Napi::Env env = info.Env();
+                    if (info.Length() < 2 || !info[0].IsArray() || !info[1].IsFunction()) {
+                        throw Napi::TypeError::New(env, "write requires an array of Buffers and a function");
+                    }
+
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if (error) {
+                        throw Napi::Error::New(env, *error);
+                    } else if (finished || cancelled) {
+                        throw Napi::Error::New(env, "The sink was closed");
+                    }
+                    lock.unlock();
+
+                    const auto buffers = info[0].As<Napi::Array>();
+                    batch::contents data;
+                    data.chunks.reserve(buffers.Length());
+                    data.refs.reserve(buffers.Length());
+                    for (uint32_t i = 0; i < buffers.Length(); i++) {
+                        const Napi::Value val = buffers.Get(i);
+                        if (!val.IsBuffer()) {
+                            deleteRefs(env, data.refs);
+                            throw Napi::TypeError::New(env, "write requires an array of Buffers");
+                        }
+
+                        // Keep the Buffer alive until the consumer released it
+                        const auto buf = val.As<Napi::Buffer<uint8_t>>();
+                        napi_ref ref;
+                        if (napi_create_reference(env, buf, 1, &ref) != napi_ok) {
+                            deleteRefs(env, data.refs);
+                            throw Napi::Error::New(env, "Could not create a reference to the Buffer");
+                        }
+
+                        data.refs.push_back(ref);
+                        data.chunks.emplace_back(buf.Data(), buf.Length());
+                        data.bytes += buf.Length();
+                    }
+
+                    // Called once the consumer released the batch, javascript
+                    // may reuse the Buffers once it was called
+                    if (napi_create_reference(env, info[1], 1, &data.callback) != napi_ok) {
+                        deleteRefs(env, data.refs);
+                        throw Napi::Error::New(env, "Could not create a reference to the callback");
+                    }
+
+                    lock.lock();
+                    outstanding++;
+                    queue.push_back(std::move(data));
+                    lock.unlock();
+                    data_cv.notify_one();
+
+                    this->keepAlive(env);
                 }
 
-                if (this->ptr && !this->ptr->stopped) {
-                    this->ptr->fn->asyncCall(std::forward<Args>(args)..., callback, on_error);
-                } else {
-                    throw std::runtime_error("Callback was never initialized");
+                /**
+                 * End the stream. Called by the writer's end().
+                 *
+                 * @param info the callback info, info[0] is the function
+                 *             to call once the consumer released all data
+                 * @return true, if the consumer already released all data
+                 */
+                bool end(const Napi::CallbackInfo &info) {
+                    if (info.Length() < 1 || !info[0].IsFunction()) {
+                        throw Napi::TypeError::New(info.Env(), "end requires a function");
+                    }
+
+                    std::unique_lock<std::mutex> lock(mtx);
+                    finished = true;
+                    const bool done = outstanding == 0;
+                    if (done) this->releaseIfDone();
+                    lock.unlock();
+                    data_cv.notify_all();
+
+                    if (!done) {
+                        final_cb = Napi::Persistent(info[0].As<Napi::Function>());
+                        this->keepAlive(info.Env());
+                    }
+
+                    return done;
                 }
-            }
 
-            /**
-             * Call the javascript function.
-             *
-             * @param args the function arguments
-             * @return a promise to be resolved
-             */
-            std::future<R> call(Args...args) {
-                std::shared_ptr<std::promise<R>> promise = std::make_shared<std::promise<R>>();
-                this->operator()(args..., [promise](const R &val) {
-                    promise->set_value(val);
-                }, [promise](const std::exception &e) {
-                    promise->set_exception(std::make_exception_ptr(e));
-                });
+                /**
+                 * Stop writing and drop all queued batches.
+                 * Called by the writer's abort().
+                 *
+                 * @param env the environment to work in
+                 */
+                void abort(const Napi::Env &env) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cancelled = true;
+                    std::deque<batch::contents> dropped;
+                    dropped.swap(queue);
+                    outstanding -= dropped.size();
+                    lock.unlock();
+                    data_cv.notify_all();
+
+                    // The stream was destroyed, the write callbacks are not called
+                    for (const auto &d: dropped) {
+                        deleteRefs(env, d.refs);
+                        napi_delete_reference(env, d.callback);
+                    }
 
-                return promise->get_future();
-            }
+                    final_cb.Reset();
+                    this->collect(env);
+                }
 
-            /**
-             * Call the javascript function with a supplied promise.
-             *
-             * @param args the function arguments
-             * @param promise the promise to be resolved
-             */
-            void call(Args...args, std::promise<R> &promise) {
-                this->operator()(args..., [&promise](const R &val) {
-                    promise.set_value(val);
-                }, [&promise](const napi_tools::exception &e) {
-                    promise.set_exception(std::make_exception_ptr(e));
-                });
-            }
+                /**
+                 * Release a batch read by the consumer.
+                 * Called on any thread.
+                 *
+                 * @param data the contents of the batch
+                 */
+                void release(batch::contents &&data) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    outstanding--;
+                    if (released) return;
+
+                    // The references are deleted and the callback
+                    // is called on the javascript thread
+                    garbage.insert(garbage.end(), data.refs.begin(), data.refs.end());
+                    written.push_back(data.callback);
+                    this->schedule();
+                }
 
-            /**
-             * Call the javascript function and wait for it to finish
-             *
-             * @param args the function arguments
-             * @return the function return value
-             */
-            R callSync(Args...args) {
-                std::promise<R> promise;
-                std::future<R> future = promise.get_future();
-                this->call(std::forward<Args>(args)..., promise);
+                /**
+                 * Wake up the javascript thread. Must be called with the lock held.
+                 */
+                void schedule() {
+                    if (!scheduled && !released) {
+                        scheduled = ts_fn.NonBlockingCall(this, [](Napi::Env env, Napi::Function, state *s) {
+                            {
+                                std::unique_lock<std::mutex> lock(s->mtx);
+                                s->scheduled = false;
+                            }
 
-                return future.get();
-            }
+                            s->collect(env);
+                        }) == napi_ok;
+                    }
+                }
+
+                /**
+                 * Release the thread-safe function once the stream
+                 * ended and all data was released. Must be called with the lock held.
+                 */
+                void releaseIfDone() {
+                    if ((cancelled || finished) && outstanding == 0 && garbage.empty() && written.empty() && !released) {
+                        released = true;
+                        ts_fn.Release();
+                    }
+                }
+
+                /**
+                 * Keep the process alive until the consumer released all data.
+                 * Called on the javascript thread.
+                 *
+                 * @param env the environment to work in
+                 */
+                void keepAlive(const Napi::Env &env) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if (!referenced && !released) {
+                        ts_fn.Ref(env);
+                        referenced = true;
+                    }
+
+                    // The consumer may have released the data already
+                    this->schedule();
+                }
+
+                /**
+                 * Delete the references to released Buffers and call the
+                 * callbacks waiting for the consumer. Called on the javascript thread.
+                 * If the consumer failed the stream, the batches it did not read
+                 * are dropped and their callbacks are called with the error.
+                 *
+                 * @param env the environment to work in
+                 */
+                void collect(const Napi::Env &env) {
+                    NAPI_TOOLS_TRACE_SPAN("stream", "collect");
+                    std::unique_lock<std::mutex> lock(mtx);
+                    std::vector<napi_ref> refs;
+                    refs.swap(garbage);
+                    std::vector<napi_ref> callbacks;
+                    callbacks.swap(written);
+                    std::deque<batch::contents> dropped;
+                    if (error) {
+                        dropped.swap(queue);
+                        outstanding -= dropped.size();
+                    }
+
+                    const bool done = outstanding == 0;
+                    const std::optional<std::string> err = error;
+                    lock.unlock();
+
+                    deleteRefs(env, refs);
+                    for (const auto &d: dropped) {
+                        deleteRefs(env, d.refs);
+                        callbacks.push_back(d.callback);
+                    }
+
+                    // The first exception thrown by a callback fails the stream
+                    std::optional<std::string> thrown;
+                    Napi::HandleScope scope(env);
+                    for (napi_ref ref: callbacks) {
+                        napi_value fn;
+                        const napi_status status = napi_get_reference_value(env, ref, &fn);
+                        napi_delete_reference(env, ref);
+                        if (status == napi_ok) {
+                            std::optional<std::string> e = call(env, Napi::Function(env, fn), err);
+                            if (!thrown) thrown = std::move(e);
+                        }
+                    }
+
+                    if (!final_cb.IsEmpty() && (done || err)) {
+                        const Napi::FunctionReference cb = std::move(final_cb);
+                        std::optional<std::string> e = call(env, cb.Value(), err);
+                        if (!thrown) thrown = std::move(e);
+                    }
+
+                    lock.lock();
+                    if (thrown && !error) {
+                        error = std::move(thrown);
+                        this->schedule();
+                    }
+
+                    if (outstanding == 0 && final_cb.IsEmpty() && referenced && !released) {
+                        ts_fn.Unref(env);
+                        referenced = false;
+                    }
+
+                    this->releaseIfDone();
+                }
+
+                /**
+                 * Call a stream callback. Exceptions thrown by the
+                 * callback are returned instead of being propagated
+                 * out of the thread-safe function call.
+                 *
+                 * @param env the environment to work in
+                 * @param cb the callback
+                 * @param err the error to pass to the callback
+                 * @return the message of the exception thrown by the callback, if any
+                 */
+                static std::optional<std::string> call(const Napi::Env &env, const Napi::Function &cb,
+                                                       const std::optional<std::string> &err) {
+                    try {
+                        if (err) {
+                            cb.Call({Napi::Error::New(env, *err).Value()});
+                        } else {
+                            cb.Call({});
+                        }
+                    } catch (const Napi::Error &e) {
+                        return e.Message();
+                    }
+
+                    return std::nullopt;
+                }
+
+                /**
+                 * Delete Buffer references. Called on the javascript thread.
+                 *
+                 * @param env the environment to work in
+                 * @param refs the references to delete
+                 */
+                static void deleteRefs(const Napi::Env &env, const std::vector<napi_ref> &refs) {
+                    for (napi_ref ref: refs) {
+                        napi_delete_reference(env, ref);
+                    }
+                }
+
+                sink_options opts;
+                std::mutex mtx;
+                // Signalled when batches were written or the stream ended
+                std::condition_variable data_cv;
+                std::deque<batch::contents> queue;
+                // The number of batches written and not yet released by the consumer
+                size_t outstanding = 0;
+                // The references to delete on the javascript thread
+                std::vector<napi_ref> garbage;
+                // The write callbacks of released batches to call on the javascript thread
+                std::vector<napi_ref> written;
+                // The error passed to javascript
+                std::optional<std::string> error;
+                // Set once javascript ended the stream
+                bool finished = false;
+                // Set once javascript aborted the stream or the environment shut down
+                bool cancelled = false;
+                // Whether the javascript thread was woken up already
+                bool scheduled = false;
+                // Whether the thread-safe function was released or finalized
+                bool released = false;
+                Napi::ThreadSafeFunction ts_fn;
+
+                // Only accessed on the javascript thread
+                Napi::FunctionReference final_cb;
+                bool referenced = false;
+            };
 
             /**
-             * Call the javascript function async.
+             * Take the next batch from the queue. Must be called with the lock held.
              *
-             * @param args the function arguments
-             * @param callback the callback function to be called, as this is async
+             * @return the next batch or std::nullopt if the queue is empty
              */
-            void operator()(Args...args, const std::function<void(R)> &callback,
-                            const callbacks::error_func &on_error) {
-                this->call(args..., callback, on_error);
+            std::optional<batch> pop() {
+                state &s = *st;
+                if (s.queue.empty() || s.cancelled) return std::nullopt;
+
+                batch b(st, std::move(s.queue.front()));
+                s.queue.pop_front();
+                return b;
             }
 
             /**
-             * Call the javascript function.
-             * Example usage:<br>
-             *
-             * <p><code>
-             * std::promise&lt;int&gt; promise = callback();<br>
-             * std::future&lt;int&gt; fut = promise.get_future();<br>
-             * fut.wait();<br>
-             * int res = fut.get();
-             * </code></p>
+             * Get the state
              *
-             * @param args the function arguments
-             * @return a promise to be resolved
+             * @return the state
              */
-            std::future<R> operator()(Args...args) {
-                return this->call(args...);
+            state &get() const {
+                if (!st) {
+                    throw std::runtime_error("The sink is not initialized");
+                }
+
+                return *st;
             }
 
             /**
-             * Call the javascript function with a supplied promise.
-             * Example:<br>
-             *
-             * <p><code>
-             * std::promise&lt;int&gt; promise;<br>
-             * callback(promise);<br>
-             * std::future&lt;int&gt; future = promise.get_future();<br>
-             * int res = future.get();
-             * </p></code>
+             * Called once the thread-safe function is finalized,
+             * either after it was released or the environment shut down
              *
-             * @param args the function arguments
-             * @param promise the promise to be resolved
+             * @param ctx the state
              */
-            void operator()(Args...args, std::promise<R> &promise) {
-                this->call(args..., promise);
+            static void FinalizerCallback(Napi::Env, void *, std::shared_ptr<state> *ctx) {
+                std::unique_ptr<std::shared_ptr<state>> s(ctx);
+                std::unique_lock<std::mutex> lock((*s)->mtx);
+                (*s)->released = true;
+                (*s)->cancelled = true;
+                lock.unlock();
+                (*s)->data_cv.notify_all();
+
+                // The consumer may outlive the environment
+                (*s)->final_cb.Reset();
             }
+
+            std::shared_ptr<state> st;
         };
-    } // namespace callbacks
+    } // namespace streams
 } // namespace napi_tools
 #endif // NAPI_TOOLS_NAPI_TOOLS_HPP
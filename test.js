@@ -1,9 +1,11 @@
 const native = require('./build/Release/napi_tools.node');
+const {streams} = require('.');
 
 console.log("Native addon:", native);
-native.promiseTest().then((res) => {
+const tests = [];
+tests.push(native.promiseTest().then((res) => {
     console.log(res);
-}).catch(e => console.error(e.stack));
+}).catch(e => console.error(e.stack)));
 
 native.setCallback((a, b) => {
     console.log(`Callback values: ${a}, ${b}`);
@@ -37,9 +39,166 @@ native.setPromiseCallback(() => {
     });
 });
 
-native.callMeMaybe();
+native.setBenchmarkCallback(() => {});
+native.setAllocationCallback(() => {});
+native.setOverflowCallback(() => {});
+
+tests.push(native.callMeMaybe().catch(e => console.error(e.stack)));
 native.promiseCallback();
 
+native.setAsyncCallback(async (i) => {
+    await new Promise(resolve => setTimeout(resolve, 10));
+    return i * 2;
+});
+
+tests.push(native.callAsyncCallback(21).then((res) => {
+    console.log(`Async callback returned: ${res}`);
+}).catch(e => console.error(e.stack)));
+
+tests.push(native.benchmarkCallback(200).then((res) => {
+    console.log(`Callback latency (us): p50: ${res.p50}, p99: ${res.p99}`);
+    console.log(`Callback throughput: ${res.callsPerSecond} calls/s`);
+
+    // Polling the queue every 10 ms added about 5 ms to every call. Event-driven
+    // dispatch takes microseconds, the limits leave plenty of room for slow machines.
+    if (res.p50 > 2000 || res.p99 > 50000) {
+        console.error(`Callback latency too high: p50: ${res.p50} us (limit 2000), p99: ${res.p99} us (limit 50000)`);
+        process.exitCode = 1;
+    }
+    const stats = native.getBenchmarkStats();
+    console.log(`Callback queue latency (ns): p50: ${stats.queueLatency.p50}, p99: ${stats.queueLatency.p99}`);
+
+    // Every call is counted and timed before the javascript function runs
+    if (stats.calls !== 200 || stats.queueLatency.count !== 200 || stats.jsTime.count !== 200 ||
+        stats.queueLatency.p50 > stats.queueLatency.p99 || stats.queueLatency.p99 > 50e6 ||
+        stats.errors !== 0 || res.callsPerSecond < 500) {
+        console.error(`Unexpected callback statistics: ${JSON.stringify(stats)}, ${res.callsPerSecond} calls/s`);
+        process.exitCode = 1;
+    }
+
+    // Swap the callback while it is being called, swapping must not stall the event loop
+    let maxSwapTime = 0n;
+    const swapTimer = setInterval(() => {
+        const start = process.hrtime.bigint();
+        native.setBenchmarkCallback(() => {});
+        const time = process.hrtime.bigint() - start;
+        if (time > maxSwapTime) maxSwapTime = time;
+    }, 1);
+
+    return native.benchmarkCallback(2000).finally(() => {
+        clearInterval(swapTimer);
+        console.log(`Max callback swap time (ms): ${Number(maxSwapTime) / 1e6}`);
+
+        // Resetting a callback used to sleep for 50 ms on the javascript thread
+        if (maxSwapTime > 20_000_000n) {
+            console.error(`Swapping the callback stalled the event loop for ${Number(maxSwapTime) / 1e6} ms (limit 20 ms)`);
+            process.exitCode = 1;
+        }
+    });
+}).catch(e => console.error(e.stack)));
+
+// Overflow a callback with a capacity of one call. The dropped calls must fail instead of hanging.
+tests.push(Promise.race([
+    native.overflowCallback(16),
+    new Promise((resolve, reject) => setTimeout(() => reject(new Error("Dropped calls did not complete")), 5000).unref())
+]).then(({returned, dropped}) => {
+    console.log(`Overflowed callback: returned: ${returned}, dropped: ${dropped}`);
+}).catch(e => console.error(e.stack)));
+
+// Spread calls across the main thread and a worker thread
+const {Worker} = require('worker_threads');
+native.setWorkerCallback((i) => i);
+const worker = new Worker(`
+    const {parentPort} = require('worker_threads');
+    const native = require(${JSON.stringify(require.resolve('./build/Release/napi_tools.node'))});
+    native.setWorkerCallback((i) => i);
+    parentPort.postMessage('ready');
+`, {eval: true});
+
+tests.push(new Promise(resolve => worker.once('message', resolve)).then(() => {
+    return native.callWorkers(100);
+}).then((sum) => {
+    console.log(`Worker callbacks returned: ${sum}`);
+}).catch(e => console.error(e.stack)));
+
+// Pass one event to multiple listeners, a failing listener does not affect the others
+const listener = (event) => console.log(`Listener 1 received: ${event}`);
+const failingListener = () => {
+    throw new Error("Listener failed");
+};
+
+native.addEventListener(listener);
+native.addEventListener((event) => console.log(`Listener 2 received: ${event}`));
+native.addEventListener(failingListener);
+
+tests.push(native.emitEvent("first event").then(() => {
+    console.error("The failing listener did not fail the call");
+}, (e) => {
+    console.log(`Expected error thrown: ${e.message}`);
+    native.removeEventListener(failingListener);
+    native.removeEventListener(listener);
+    return native.emitEvent("second event");
+}).catch(e => console.error(e.stack)));
+
+// Read a stream of numbers written by a native thread
+tests.push((async () => {
+    let chunks = 0, sum = 0;
+    for await (const chunk of native.streamNumbers(1000)) {
+        chunks++;
+        sum += chunk.reduce((a, b) => a + b, 0);
+    }
+
+    console.log(`Streamed numbers: sum: ${sum}, chunks: ${chunks}`);
+})().catch(e => console.error(e.stack)));
+
+// Read bytes written by a native thread using a Readable stream
+tests.push(new Promise((resolve, reject) => {
+    let bytes = 0;
+    streams.toReadable(native.streamBytes(1024))
+        .on('data', (buf) => bytes += buf.length)
+        .on('end', () => {
+            console.log(`Streamed bytes: ${bytes}`);
+            resolve();
+        })
+        .on('error', reject);
+}).catch(e => console.error(e.stack)));
+
+// Write bytes to a native consumer using a Writable stream
+tests.push((async () => {
+    const {writer, total} = native.consumeBytes();
+    const writable = streams.toWritable(writer);
+    for (let i = 0; i < 1024; i++) {
+        if (!writable.write(Buffer.alloc(1024, i))) {
+            await new Promise(resolve => writable.once('drain', resolve));
+        }
+    }
+
+    writable.end();
+    console.log(`Consumed bytes: ${await total}`);
+})().catch(e => console.error(e.stack)));
+
+// Reuse one batch object in the consumer. The stream stalls
+// if assigning a batch does not release the previous one.
+tests.push((async () => {
+    const {writer, total} = native.consumeBytesReused();
+    const writable = streams.toWritable(writer);
+    for (let i = 0; i < 1024; i++) {
+        if (!writable.write(Buffer.alloc(1024, i))) {
+            await new Promise(resolve => writable.once('drain', resolve));
+        }
+    }
+
+    writable.end();
+    const consumed = await total;
+    if (consumed !== 1024 * 1024) {
+        console.error(`Consumed ${consumed} bytes using a reused batch, expected ${1024 * 1024}`);
+        process.exitCode = 1;
+    }
+})().catch(e => {
+    console.error(e.stack);
+    process.exitCode = 1;
+}));
+
 native.checkNullOrUndefined(null);
 native.checkNullOrUndefined(undefined);
 
@@ -49,7 +208,22 @@ try {
     console.log(`Expected error thrown: ${e.message}`);
 }
 
-setTimeout(() => {
-    process.exit();
-    //native.stopCallback();
-}, 5000);
+// Calls must not allocate once the queues have grown. Measured once
+// the other tests finished, so no other calls are made meanwhile.
+const allTests = Promise.all(tests).then(() => native.countCallAllocations(100)).then((count) => {
+    if (count === 0) {
+        console.log("Calls do not allocate");
+    } else {
+        console.error(`Calls allocated ${count} times`);
+        process.exitCode = 1;
+    }
+}).catch(e => {
+    console.error(e.stack);
+    process.exitCode = 1;
+});
+
+// Stop all callbacks once the tests finished, so the process exits on its own
+allTests.finally(() => {
+    native.stopCallbacks();
+    worker.terminate();
+});